@@ -210,6 +210,25 @@ public:
         ifs.close();
         return true;
     }
+    // 以只读方式打开文件，同时获取文件大小，失败返回-1
+    static int OpenFile(const std::string &filepath, uint64_t *fsize)
+    {
+        int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            LOG(ERROR, "Failed to open the file: %s, code:%d, reason:%s", filepath.c_str(), errno, strerror(errno));
+            return -1;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+        {
+            LOG(ERROR, "Failed to stat the file: %s, code:%d, reason:%s", filepath.c_str(), errno, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        *fsize = st.st_size;
+        return fd;
+    }
     static bool ReadFile(const std::string &filepath, Buffer &buffer) // 读取到Buffer中
     {
         std::string fileContent;
@@ -277,7 +296,13 @@ public:
     static std::string UrlDecode(const std::string &url, bool convert_space_to_plus)
     {
         std::string result;
-        for (size_t i = 0; i < url.size(); ++i)
+        UrlDecode(url.c_str(), url.size(), convert_space_to_plus, result);
+        return result;
+    }
+    // 解码结果追加到result后面，result保留的容量足够时不申请内存
+    static void UrlDecode(const char *url, size_t len, bool convert_space_to_plus, std::string &result)
+    {
+        for (size_t i = 0; i < len; ++i)
         {
             if (url[i] == '+' && convert_space_to_plus == true)
             {
@@ -285,7 +310,7 @@ public:
             }
             else if (url[i] == '%')
             {
-                if (i + 2 < url.size())
+                if (i + 2 < len)
                 {
                     char v1 = HextoI(url[i + 1]);
                     char v2 = HextoI(url[i + 2]);
@@ -303,7 +328,6 @@ public:
                 result += url[i];
             }
         }
-        return result;
     }
 
     // 响应状态码描述解析
@@ -361,43 +385,103 @@ public:
     // 判断文件路径是否有效（只能在相对根目录下查找）
     static bool IsValidPath(const std::string &path)
     {
-        // 按照/进行目录分割，计算目录深度，如果深度小于0就是有问题
-        std::vector<std::string> subdirs;
+        // 按照/进行目录分割，计算目录深度，如果深度小于0就是有问题（直接在原字符串上扫描，不拷贝每一级目录）
         int depth = 0;
-        Split(path, "/", subdirs);
-        for (auto &str : subdirs)
+        size_t offset = 0;
+        while (offset < path.size())
         {
-            if (str == "..")
+            size_t pos = path.find('/', offset);
+            if (pos == std::string::npos)
+                pos = path.size();
+            if (pos - offset == 2 && path.compare(offset, 2, "..") == 0)
             {
                 --depth;
                 if (depth < 0)
                     return false;
             }
-            else
+            else if (pos > offset)
             {
                 ++depth;
             }
+            offset = pos + 1;
         }
         return true;
     }
 };
 
+/**
+ * StrView：指向一段不属于自己的字符串，只保存起始地址和长度，不拷贝数据
+ * C++11里面没有std::string_view，这里实现解析需要用到的最简单的部分
+ */
+class StrView
+{
+private:
+    const char *_data;
+    size_t _size;
+
+public:
+    StrView() : _data(nullptr), _size(0) {}
+    StrView(const char *data, size_t size) : _data(data), _size(size) {}
+    StrView(const std::string &str) : _data(str.c_str()), _size(str.size()) {}
+    const char *Data() const { return _data; }
+    size_t Size() const { return _size; }
+    bool Empty() const { return _size == 0; }
+    char operator[](size_t i) const { return _data[i]; }
+    std::string ToString() const { return std::string(_data, _size); }
+    bool Equal(const char *str) const
+    {
+        size_t len = strlen(str);
+        return len == _size && memcmp(_data, str, len) == 0;
+    }
+    bool EqualIgnoreCase(const char *str) const
+    {
+        size_t len = strlen(str);
+        return len == _size && strncasecmp(_data, str, len) == 0;
+    }
+};
+
 // 请求解析 GET /index.html?word=C++ HTTP/1.1
 /**
  * HttpRequest，对http协议的请求报文进行解析
+ * 解析器只记录各个部分在输入缓冲区中的位置，不拷贝数据，通过Method()/Path()/HeaderView()等接口以视图的形式访问
+ * 下面的字符串成员由Materialize()填充，HttpServer默认在路由之前调用，处理函数可以直接访问这些成员
+ * HttpServer开启零拷贝模式（EnableLazyRequest）之后不再填充，处理函数只能通过上面的视图接口和GetParam/HaveParam等接口读取
+ * _path例外：两种模式下路由之前都会把解码后的路径写入_path，连接上的请求复用同一个HttpRequest，_path保留的容量足够时解码不申请内存
 */
 class HttpRequest
 {
 public:
     std::string _method;                                   // 请求方法
-    std::string _path;                                     // 请求路径
+    std::string _path;                                     // 请求路径（解码后）
     std::string _version;                                  // 请求版本
     std::unordered_map<std::string, std::string> _headers; // 请求头KV结构
     std::unordered_map<std::string, std::string> _params;  // 查询字符串
     std::string _body;                                     // 请求正文
-    std::smatch _match;                                    // 正则化的资源路径
+    std::smatch _match;                                    // 正则化的资源路径（只有正则表达式路由会设置）
+    std::vector<std::pair<StrView, StrView>> _route_params; // 路由捕获的参数，名字指向路由表，值指向_path
 public:
-    HttpRequest() : _version("HTTP/1.1") {}
+    /* 零拷贝解析的结果：位置都是相对于请求在输入缓冲区中的起始位置，_base在请求接收完整之后指向这个起始位置
+       处理函数返回之前输入缓冲区不会被移动和修改，返回之后请求数据从缓冲区中移除，这些视图也就失效了 */
+    struct Span
+    {
+        uint32_t _offset;
+        uint32_t _length;
+    };
+    const char *_base;                                   // 请求在输入缓冲区中的起始地址
+    Span _method_span;                                   // 请求方法
+    Span _path_span;                                     // 请求路径（未解码）
+    Span _query_span;                                    // 查询字符串（未解码）
+    Span _version_span;                                  // 请求版本
+    Span _body_span;                                     // 请求正文
+    std::vector<std::pair<Span, Span>> _header_spans;    // 请求头，Reset之后保留容量，连接上后续的请求不再申请内存
+    bool _materialized;                                  // 字符串成员是否已经填充
+    bool _path_decoded;                                  // _path是否已经由_path_span解码得到
+
+private:
+    StrView View(const Span &span) const { return StrView(_base + span._offset, span._length); }
+
+public:
+    HttpRequest() : _version("HTTP/1.1"), _base(nullptr), _materialized(false), _path_decoded(false) { ResetSpans(); }
     // 重置
     void Reset()
     {
@@ -409,6 +493,80 @@ public:
         _body.clear();
         std::smatch match;
         _match.swap(match);
+        _route_params.clear();
+        ResetSpans();
+    }
+    void ResetSpans()
+    {
+        _base = nullptr;
+        _method_span = _path_span = _query_span = _version_span = _body_span = Span{0, 0};
+        _header_spans.clear();
+        _materialized = false;
+        _path_decoded = false;
+    }
+    // 零拷贝访问接口：请求由解析器得到时返回输入缓冲区中的视图，否则返回对应字符串成员的视图
+    StrView Method() const { return _base ? View(_method_span) : StrView(_method); }
+    StrView Path() const { return _base ? View(_path_span) : StrView(_path); }
+    StrView Query() const { return _base ? View(_query_span) : StrView(); }
+    StrView Version() const { return _base ? View(_version_span) : StrView(_version); }
+    StrView Body() const { return _base ? View(_body_span) : StrView(_body); }
+    // 查找头部字段的值，头部字段名不区分大小写，没有找到返回的视图Data()为nullptr
+    // 先查找_headers（填充之后的头部和SetHeader设置的头部），再查找输入缓冲区中的头部
+    StrView HeaderView(const char *key) const
+    {
+        for (auto &h : _headers)
+        {
+            if (StrView(h.first).EqualIgnoreCase(key))
+                return StrView(h.second);
+        }
+        if (_base == nullptr)
+            return StrView();
+        for (auto &h : _header_spans)
+        {
+            if (View(h.first).EqualIgnoreCase(key))
+                return View(h.second);
+        }
+        return StrView();
+    }
+    // 把请求路径解码到_path中，路由按照解码后的路径匹配；重复调用不会重新解码，路由捕获的参数指向_path
+    void DecodePath()
+    {
+        if (_base == nullptr || _path_decoded)
+            return;
+        _path_decoded = true;
+        _path.clear(); // 保留容量
+        Util::UrlDecode(_base + _path_span._offset, _path_span._length, false, _path); // 解析url,不需要'+'->' '
+    }
+    // 把解析得到的视图转换为字符串成员，提供给直接访问成员的处理函数使用
+    void Materialize()
+    {
+        if (_base == nullptr || _materialized)
+            return;
+        _materialized = true;
+        _method = View(_method_span).ToString();
+        DecodePath();
+        _version = View(_version_span).ToString();
+        for (auto &h : _header_spans)
+            _headers.insert(std::make_pair(View(h.first).ToString(), View(h.second).ToString())); // 不覆盖SetHeader设置的头部
+        std::vector<std::string> query_array;
+        Util::Split(View(_query_span).ToString(), "&", query_array);
+        for (auto &str : query_array)
+        {
+            // 格式在解析的时候已经检查过了，每一项都有=
+            size_t pos = str.find("=");
+            _params.insert(std::make_pair(str.substr(0, pos), str.substr(pos + 1))); // 不覆盖SetParam设置的参数
+        }
+        _body = View(_body_span).ToString();
+    }
+    // 获取路由捕获的参数（:name和*name），没有找到返回的视图Data()为nullptr
+    StrView RouteParam(const char *name) const
+    {
+        for (auto &p : _route_params)
+        {
+            if (p.first.Equal(name))
+                return p.second;
+        }
+        return StrView();
     }
     // 插入头部字符串
     void SetHeader(const std::string &key, const std::string &value)
@@ -416,63 +574,67 @@ public:
         _headers[key] = value;
     }
     // 判断是否存在头部字符串
-    bool HaveHeader(const std::string &key)
+    bool HaveHeader(const std::string &key) const
     {
-        return _headers.find(key) != _headers.end();
+        return HeaderView(key.c_str()).Data() != nullptr;
     }
     // 获取指定头部字段的值
-    std::string GetHeader(const std::string &key)
+    std::string GetHeader(const std::string &key) const
     {
-        auto it = _headers.find(key);
-        if (it == _headers.end())
-        {
-            return "";
-        }
-        return it->second;
+        return HeaderView(key.c_str()).ToString();
     }
     // 插入查询字符串
     void SetParam(const std::string &key, const std::string &value)
     {
         _params[key] = value;
     }
+    // 查找查询字符串的值（未解码），没有找到返回的视图Data()为nullptr
+    // 先查找_params（填充之后的参数和SetParam设置的参数），没有填充的时候再在输入缓冲区中的查询字符串里查找
+    StrView ParamView(const std::string &key) const
+    {
+        auto it = _params.find(key);
+        if (it != _params.end())
+            return StrView(it->second);
+        if (_base == nullptr || _materialized)
+            return StrView();
+        StrView query = View(_query_span);
+        size_t item = 0;
+        while (item < query.Size())
+        {
+            // 格式在解析的时候已经检查过了，每一项都有=
+            const char *begin = query.Data() + item;
+            const char *amp = (const char *)memchr(begin, '&', query.Size() - item);
+            size_t len = amp ? amp - begin : query.Size() - item;
+            const char *eq = (const char *)memchr(begin, '=', len);
+            if (eq != nullptr && (size_t)(eq - begin) == key.size() && memcmp(begin, key.c_str(), key.size()) == 0)
+                return StrView(eq + 1, begin + len - eq - 1);
+            item += len + 1;
+        }
+        return StrView();
+    }
     // 判断是否存在查询字符串
-    bool HaveParam(const std::string &key)
+    bool HaveParam(const std::string &key) const
     {
-        return _params.find(key) != _params.end();
+        return ParamView(key).Data() != nullptr;
     }
     // 获取指定查询字符串
-    std::string GetParam(const std::string &key)
+    std::string GetParam(const std::string &key) const
     {
-        auto it = _params.find(key);
-        if (it == _params.end())
-        {
-            return "";
-        }
-        return it->second;
+        return ParamView(key).ToString();
     }
     // 获取正文长度
-    size_t GetBodyLength()
+    size_t GetBodyLength() const
     {
-        auto it = _headers.find("Content-Length");
-        if (it == _headers.end())
-        {
-            return 0;
-        }
-        return std::stol(it->second);
+        StrView val = HeaderView("Content-Length");
+        size_t len = 0;
+        for (size_t i = 0; i < val.Size() && isdigit((unsigned char)val[i]); ++i)
+            len = len * 10 + (val[i] - '0');
+        return len;
     }
     // 判断是否是长连接
-    bool KeepAlive()
+    bool KeepAlive() const
     {
-        auto it = _headers.find("Connection");
-        if (it == _headers.end())
-        {
-            return false;
-        }
-        if (it->second == "keep-alive")
-        {
-            return true;
-        }
-        return false;
+        return HeaderView("Connection").Equal("keep-alive");
     }
 };
 
@@ -484,13 +646,16 @@ class HttpResponse
 public:
     int _status_code = 200;                                // 响应状态码
     std::string _status_msg;                               // 响应状态描述
-    std::unordered_map<std::string, std::string> _headers; // 响应头KV结构,头部字段
+    std::vector<std::pair<std::string, std::string>> _headers; // 响应头字段，头部只有几个，顺序查找；ReSet之后保留容量
     std::string _body;                                     // 响应正文
     bool _rediret_flag;                                    // 是否是重定向
     std::string _rediret_url;                              // 重定向url
+    int _file_fd;                                          // 文件正文的描述符，-1表示没有文件正文
+    uint64_t _file_size;                                   // 文件正文的长度
 
 public:
-    HttpResponse(int status = 200, bool flag = false) : _rediret_flag(flag), _status_code(status) {}
+    HttpResponse(int status = 200, bool flag = false) : _rediret_flag(flag), _status_code(status), _file_fd(-1), _file_size(0) {}
+    ~HttpResponse() { CloseFile(); }
     void ReSet()
     {
         _status_code = 200;
@@ -499,26 +664,45 @@ public:
         _body.clear();
         _rediret_flag = false;
         _rediret_url.clear();
+        CloseFile();
+    }
+    // 查找头部字段，没有找到返回nullptr
+    const std::string *FindHeader(const std::string &key) const
+    {
+        for (auto &h : _headers)
+        {
+            if (h.first == key)
+                return &h.second;
+        }
+        return nullptr;
     }
     // 头部字段的增加查询获取
     void SetHeader(const std::string &key, const std::string &value)
     {
-        _headers[key] = value;
+        for (auto &h : _headers)
+        {
+            if (h.first == key)
+            {
+                h.second = value;
+                return;
+            }
+        }
+        _headers.push_back(std::make_pair(key, value));
     }
     // 判断是否存在头部字段
     bool HaveHeader(const std::string &key)
     {
-        return _headers.find(key) != _headers.end();
+        return FindHeader(key) != nullptr;
     }
     // 获取头部字段
     std::string GetHeader(const std::string &key)
     {
-        auto it = _headers.find(key);
-        if (it == _headers.end())
+        const std::string *value = FindHeader(key);
+        if (value == nullptr)
         {
             return "";
         }
-        return it->second;
+        return *value;
     }
     // 设置正文
     void SetContent(std::string &body, std::string type = "text/html")
@@ -526,6 +710,31 @@ public:
         _body = body;
         SetHeader("Content-Type", type);
     }
+    // 设置文件正文，发送的时候直接用sendfile发送文件内容，不读入内存
+    bool SetFile(const std::string &filepath, const std::string &type)
+    {
+        CloseFile();
+        _file_fd = Util::OpenFile(filepath, &_file_size);
+        if (_file_fd < 0)
+            return false;
+        SetHeader("Content-Type", type);
+        return true;
+    }
+    bool HaveFile() { return _file_fd >= 0; }
+    // 取走文件正文的描述符，所有权交给调用者
+    int ReleaseFile()
+    {
+        int fd = _file_fd;
+        _file_fd = -1;
+        return fd;
+    }
+    void CloseFile()
+    {
+        if (_file_fd >= 0)
+            close(_file_fd);
+        _file_fd = -1;
+        _file_size = 0;
+    }
     void SetRediret(std::string &url, int statu = 302) // 设置重定向
     {
         _rediret_flag = true;
@@ -535,13 +744,13 @@ public:
     // 判断是否是长连接
     bool KeepAlive()
     {
-        auto it = _headers.find("Connection");
-        if (it == _headers.end())
+        const std::string *value = FindHeader("Connection");
+        if (value == nullptr)
         {
             return false;
         }
-        // LOG(DEBUG, "[%s]", it->second.c_str());
-        if (it->second == "keep-alive")
+        // LOG(DEBUG, "[%s]", value->c_str());
+        if (*value == "keep-alive")
         {
             return true;
         }
@@ -564,182 +773,267 @@ const static int MAX_LINE_SIZE = 8192;
 class HttpContext
 {
 private:
-    int _response_statu;   // 响应状态码
-    HttpState _recv_state; // 当前接收状态
-    HttpRequest _request;  // 已经解析得到的请求
+    int _response_statu;        // 响应状态码
+    HttpState _recv_state;      // 当前接收状态
+    HttpRequest _request;       // 已经解析得到的请求
+    HttpResponse _response;     // 当前请求的响应，连接上的请求复用同一个对象，头部字段数组保留容量
+    std::string _response_head; // 组织响应头部的缓冲区，每次使用前清空，保留容量
+    /* 解析过程中不移动缓冲区的读位置，请求接收完整之前数据都留在缓冲区中，下面的位置都相对于缓冲区的读位置
+       数据不够一行的时候记住已经扫描到的位置，下次收到数据从这里继续，不重复扫描 */
+    uint64_t _scan_offset;    // 已经扫描过的长度
+    uint64_t _line_offset;    // 当前行的起始位置
+    int64_t _colon_offset;    // 当前行中第一个':'的位置，-1表示还没有找到
+    uint64_t _content_length; // 解析请求头时得到的正文长度
+    /* 请求行的解析状态 */
+    enum LineState
+    {
+        LINE_METHOD,  // 请求方法
+        LINE_PATH,    // 请求路径
+        LINE_QUERY,   // 查询字符串
+        LINE_VERSION, // 请求版本
+        LINE_LF       // 收到了CR，等待LF
+    };
+    LineState _line_state;
+    uint64_t _method_end;       // 请求方法后面空格的位置
+    uint64_t _path_end;         // 请求路径后面?或者空格的位置
+    uint64_t _version_begin;    // 请求版本的起始位置
+    uint64_t _query_item_begin; // 当前表单项的起始位置
+    bool _query_item_eq;        // 当前表单项中是否有=
 private:
-    bool ParseRequestLine(const std::string &line) // 解析请求行
+    static HttpRequest::Span MakeSpan(const char *base, const char *begin, const char *end)
     {
-        if (_recv_state != RECV_HTTP_LINE)
-            return false;
-        std::smatch matches;
-        std::regex reg("(GET|HEAD|POST|PUT|DELETE) ([^?]*)(?:\\?(.*))? (HTTP/1\\.[01])(?:\n|\r\n)?", std::regex::icase); // 正则表达式解析首行
-        bool ret = std::regex_match(line, matches, reg);
-        if (ret == false)
+        return HttpRequest::Span{(uint32_t)(begin - base), (uint32_t)(end - begin)};
+    }
+    bool SetError(int statu)
+    {
+        _recv_state = RECV_HTTP_ERROR;
+        _response_statu = statu;
+        return false;
+    }
+    // 请求方法，RFC 9110定义的方法以及PATCH
+    static bool IsValidMethod(const StrView &method)
+    {
+        static const char *methods[] = {"GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE", "PATCH"};
+        for (const char *m : methods)
         {
-            _recv_state = RECV_HTTP_ERROR;
-            _response_statu = 400; // BAD REQUEST
-            return false;
-        }
-        _request._method = matches[1]; // 请求方法
-        // 将请求方法转换为全大写
-        std::transform(_request._method.begin(), _request._method.end(), _request._method.begin(), ::toupper); // 这里的::表示的是toupper是一个全局接口
-        _request._path = Util::UrlDecode(matches[2], false);                                                   // 解析url,不需要'+'->' '
-        _request._version = matches[4];
-        std::string _request_query = matches[3]; // 表单项
-        std::vector<std::string> _request_query_array;
-        Util::Split(_request_query, "&", _request_query_array);
-        for (auto &str : _request_query_array)
-        {
-            // str是每一个表单项，用=分割
-            ssize_t pos = str.find("=");
-            if (pos == std::string::npos)
-            {
-                _recv_state = RECV_HTTP_ERROR;
-                _response_statu = 400; // BAD REQUEST
-                return false;
-            }
-            std::string key = str.substr(0, pos);
-            std::string val = str.substr(pos + 1);
-            _request.SetParam(key, val);
+            if (method.Equal(m))
+                return true;
         }
+        return false;
+    }
+    // 一行接收完整之后检查方法和版本，记录各个部分的位置，eol是换行符的位置
+    bool FinishRequestLine(char *base, uint64_t eol)
+    {
+        uint64_t end = base[eol - 1] == '\r' ? eol - 1 : eol;
+        StrView method(base, _method_end);
+        StrView version(base + _version_begin, end - _version_begin);
+        if (IsValidMethod(method) == false)
+            return SetError(400); // BAD REQUEST
+        if (!version.EqualIgnoreCase("HTTP/1.1") && !version.EqualIgnoreCase("HTTP/1.0"))
+            return SetError(400);
+        _request._method_span = MakeSpan(base, base, base + _method_end);
+        _request._path_span = MakeSpan(base, base + _method_end + 1, base + _path_end);
+        if (_path_end + 1 < _version_begin) // 有?，查询字符串在?和版本前面的空格之间
+            _request._query_span = MakeSpan(base, base + _path_end + 1, base + _version_begin - 1);
+        _request._version_span = MakeSpan(base, base + _version_begin, base + end);
+        _scan_offset = _line_offset = eol + 1;
         _recv_state = RECV_HTTP_HEAD;
         return true;
     }
+    /**
+     * 接收请求行：方法 SP 路径[?查询字符串] SP 版本 [CR] LF
+     * 逐字节的状态机，数据不够一行的时候保存当前状态和已经扫描到的位置，下次收到数据从这里继续
+     */
     bool RecvRequestLine(Buffer *buffer) // 接收请求行
     {
         if (_recv_state != RECV_HTTP_LINE)
         {
             return false;
         }
-        // 1. 获取一行数据（需要考虑里面数据不够一行/一行内容太大）
-        std::string line = buffer->GetLineAndPop();
-        if (line.empty()) // 里面数据不够一行
+        char *base = buffer->ReadPosition();
+        uint64_t size = buffer->ReadableSize();
+        if (size > MAX_LINE_SIZE + 1)
+            size = MAX_LINE_SIZE + 1; // 一行内容太大，只需要扫描到能判断出来的位置
+        for (uint64_t i = _scan_offset; i < size; ++i)
         {
-            if (buffer->ReadableSize() > MAX_LINE_SIZE)
+            unsigned char c = base[i];
+            switch (_line_state)
             {
-                _recv_state = RECV_HTTP_ERROR;
-                _response_statu = 414; // URI TOO LOG
-                return false;
+            case LINE_METHOD:
+                if (c == ' ' && i > 0)
+                {
+                    _method_end = i;
+                    _line_state = LINE_PATH;
+                }
+                else if (c < 'A' || c > 'Z')
+                    return SetError(400); // BAD REQUEST，请求方法区分大小写，只接受大写字母（RFC 9110 9.1）
+                break;
+            case LINE_PATH:
+                if (c == '?' || c == ' ')
+                {
+                    if (i == _method_end + 1)
+                        return SetError(400); // 请求路径不能为空
+                    _path_end = i;
+                    _line_state = c == '?' ? LINE_QUERY : LINE_VERSION;
+                    _version_begin = i + 1;
+                    _query_item_begin = i + 1;
+                    _query_item_eq = false;
+                }
+                else if (c <= ' ' || c == 0x7f)
+                    return SetError(400);
+                break;
+            case LINE_QUERY:
+                // 每一个表单项都需要用=分割
+                if (c == '&' || c == ' ')
+                {
+                    if (i > _query_item_begin && _query_item_eq == false)
+                        return SetError(400);
+                    _query_item_begin = i + 1;
+                    _query_item_eq = false;
+                    if (c == ' ')
+                    {
+                        _version_begin = i + 1;
+                        _line_state = LINE_VERSION;
+                    }
+                }
+                else if (c == '=')
+                    _query_item_eq = true;
+                else if (c < ' ' || c == 0x7f)
+                    return SetError(400);
+                break;
+            case LINE_VERSION:
+                if (c == '\r')
+                    _line_state = LINE_LF;
+                else if (c == '\n')
+                    return FinishRequestLine(base, i);
+                else if (c <= ' ' || c == 0x7f)
+                    return SetError(400);
+                break;
+            case LINE_LF:
+                if (c != '\n')
+                    return SetError(400);
+                return FinishRequestLine(base, i);
             }
-            // 缓冲区不足一行，但是也挺少，继续接收
-            return true;
-        }
-        if (line.size() > MAX_LINE_SIZE)
-        {
-            _recv_state = RECV_HTTP_ERROR;
-            _response_statu = 414; // URI TOO LOG
-            return false;
-        }
-        int ret = ParseRequestLine(line);
-        if (ret == false)
-        {
-            return false;
         }
-        // buffer->MoveReadOffset(line.size() + 2); // 移动读偏移，这里+2是因为\r\n两个字符
+        _scan_offset = size;
+        if (_scan_offset > MAX_LINE_SIZE)
+            return SetError(414); // URI TOO LOG
+        // 缓冲区不足一行，但是也挺少，继续接收
+        return true;
     }
 
     bool RecvRequestHead(Buffer *buffer) // 接收请求头
     {
         if (_recv_state != RECV_HTTP_HEAD)
             return false;
+        const char *base = buffer->ReadPosition();
+        const char *end = base + buffer->ReadableSize();
         while (true)
         {
             // 1. 获取一行数据（需要考虑里面数据不够一行/一行内容太大）
-            std::string line = buffer->GetLineAndPop();
-            if (line.empty()) // 里面数据不够一行
+            //    一遍扫描同时找到换行和这一行的第一个':'，找到':'之后这一行剩下的部分只需要找换行
+            const char *line = base + _line_offset;
+            const char *eol = base + _scan_offset;
+            while (true)
             {
-                if (buffer->ReadableSize() > MAX_LINE_SIZE)
-                {
-                    _recv_state = RECV_HTTP_ERROR;
-                    _response_statu = 414; // URI TOO LOG
-                    return false;
-                }
-                // 缓冲区不足一行，但是也挺少，继续接收
-                return true;
+                if (_colon_offset < 0)
+                    eol = ByteScanner::FindEither(eol, end, '\n', ':');
+                else
+                    eol = ByteScanner::FindByte(eol, end, '\n');
+                if (eol == nullptr || *eol == '\n')
+                    break;
+                _colon_offset = eol - base; // 找到了分隔符，继续找换行
+                ++eol;
             }
-            if (line.size() > MAX_LINE_SIZE)
+            if (eol == nullptr) // 里面数据不够一行
             {
-                _recv_state = RECV_HTTP_ERROR;
-                _response_statu = 414; // URI TOO LOG
-                return false;
+                _scan_offset = end - base;
+                if (_scan_offset - _line_offset > MAX_LINE_SIZE)
+                    return SetError(414); // URI TOO LOG
+                // 缓冲区不足一行，但是也挺少，继续接收
+                return true;
             }
-            if (line == "\r\n" || line == "\n") // 读到空行，表示头部结束
+            uint64_t len = eol - line + 1;
+            if (len > MAX_LINE_SIZE)
+                return SetError(414); // URI TOO LOG
+            _scan_offset = _line_offset = eol + 1 - base;
+            if (len == 1 || (len == 2 && line[0] == '\r')) // 读到空行，表示头部结束
             {
-                // buffer->MoveReadOffset(2); // 移动读偏移
+                _colon_offset = -1;
                 break;
             }
-            bool ret = ParseRequestHead(line);
+            bool ret = ParseRequestHead(base, line, len);
+            _colon_offset = -1;
             if (ret == false)
-            {
                 return false;
-            }
-            // buffer->MoveReadOffset(line.size() + 2); // 移动读偏移，这里+2是因为\r\n两个字符
         }
         _recv_state = RECV_HTTP_BODY;
         return true;
     }
-    bool ParseRequestHead(std::string &line) // 解析请求头
+    bool ParseRequestHead(const char *base, const char *line, uint64_t len) // 解析请求头，使用扫描时找到的':'的位置
     {
-        if (line.back() == '\n')
-            line.pop_back();
-        if (line.back() == '\r')
-            line.pop_back();
-        size_t pos = line.find(": ");
-        if (pos == std::string::npos)
+        const char *end = line + len;
+        if (end[-1] == '\n')
+            --end;
+        if (end > line && end[-1] == '\r')
+            --end;
+        const char *colon = base + _colon_offset;
+        if (_colon_offset < 0 || colon + 1 >= end || colon[1] != ' ')
+            return SetError(400); // BAD REQUEST
+        StrView key(line, colon - line);
+        StrView val(colon + 2, end - colon - 2);
+        if (key.EqualIgnoreCase("Content-Length"))
         {
-            _recv_state = RECV_HTTP_ERROR;
-            _response_statu = 400; // BAD REQUEST
-            return false;
+            _content_length = 0;
+            for (size_t i = 0; i < val.Size() && isdigit((unsigned char)val[i]); ++i)
+                _content_length = _content_length * 10 + (val[i] - '0');
         }
-        std::string key = line.substr(0, pos);
-        std::string val = line.substr(pos + 2);
-        _request.SetHeader(key, val);
+        _request._header_spans.push_back(std::make_pair(MakeSpan(base, line, colon), MakeSpan(base, colon + 2, end)));
         return true;
     }
-    bool RecvRequestBody(Buffer *buffer) // 接收请求正文
+    bool RecvRequestBody(Buffer *buffer) // 接收请求正文，正文也留在缓冲区中，收够了再记录位置
     {
         if (_recv_state != RECV_HTTP_BODY)
             return false;
-        size_t content_length = _request.GetBodyLength();
-        if (content_length == 0)
-        {
-            // 没有正文,表示请求结束
-            _recv_state = RECV_HTTP_OVER;
-            return true;
-        }
-        size_t real_length = content_length - _request._body.size(); // 实际需要接收的长度
-        if (buffer->ReadableSize() >= real_length)
+        if (buffer->ReadableSize() - _scan_offset < _content_length)
         {
-            // 缓冲区里面有正文,并且够一整条正文
-            _request._body.append(buffer->ReadPosition(), real_length);
-            buffer->MoveReadOffset(real_length);
-            _recv_state = RECV_HTTP_OVER;
-            return true;
-        }
-        else
-        {
-            // 缓冲区里面有正文，但是不够一条正文
-            _request._body.append(buffer->ReadPosition(), buffer->ReadableSize());
-            buffer->MoveReadOffset(buffer->ReadableSize());
+            // 缓冲区里面有正文，但是不够一条正文，继续接收
             return true;
         }
+        const char *base = buffer->ReadPosition();
+        _request._body_span = MakeSpan(base, base + _scan_offset, base + _scan_offset + _content_length);
+        _scan_offset += _content_length;
+        // 请求接收完整，之后缓冲区不会再变化，视图从这里开始生效
+        _request._base = base;
+        _recv_state = RECV_HTTP_OVER;
+        return true;
     }
 
 public:
-    HttpContext() : _response_statu(200), _recv_state(RECV_HTTP_LINE) {}
+    HttpContext() : _response_statu(200), _recv_state(RECV_HTTP_LINE), _scan_offset(0), _line_offset(0), _colon_offset(-1), _content_length(0),
+                    _line_state(LINE_METHOD), _method_end(0), _path_end(0), _version_begin(0), _query_item_begin(0), _query_item_eq(false) {}
     // 获取相应状态码
     int ResponseStatu() { return _response_statu; }
     // 重置上下文
     void Reset()
     {
         _request.Reset();
+        _response.ReSet();
         _response_statu = 200;
         _recv_state = RECV_HTTP_LINE;
+        _scan_offset = 0;
+        _line_offset = 0;
+        _colon_offset = -1;
+        _content_length = 0;
+        _line_state = LINE_METHOD;
     }
     // 获取接收状态
     HttpState GetState() { return _recv_state; }
     HttpRequest &Request() { return _request; }
+    HttpResponse &Response() { return _response; }
+    std::string &ResponseHead() { return _response_head; }
+    // 已经接收完整的请求在缓冲区中占用的长度，请求处理完之后从缓冲区中移除
+    uint64_t RequestSize() { return _scan_offset; }
     // 接收并解析Http请求
     void RecvHttpRequest(Buffer *buffer)
     {
@@ -752,18 +1046,209 @@ public:
             RecvRequestHead(buffer);
         case RECV_HTTP_BODY:
             RecvRequestBody(buffer);
+        default:
+            break;
         }
     }
 };
 
+/**
+ * HttpRouter：路由表，根据请求路径找到对应的处理函数
+ * 路由规则编译成一棵基数树（压缩前缀树），匹配的开销只和路径长度有关，和路由的数量无关
+ *   静态路径：/user/list
+ *   参数捕获：/user/:id/profile，:id匹配一个非空的路径段
+ *   通配尾部：*file只能作为最后一个路径段（例如跟在/static/后面），匹配剩下的所有内容
+ * 匹配的优先级是 静态路径 > 参数捕获 > 通配尾部，捕获的内容通过HttpRequest::RouteParam获取
+ * 包含正则表达式元字符的规则不能放进树中，按照注册顺序放在后面用std::regex_match逐个匹配，捕获的内容放在_match中
+ */
+class HttpRouter
+{
+public:
+    using Handler = std::function<void(const HttpRequest &, HttpResponse &)>;
+
+private:
+    struct Node
+    {
+        std::string _path;                           // 这个节点对应的静态路径片段
+        std::string _indices;                        // 每个静态子节点路径片段的首字符，和_children一一对应
+        std::vector<std::unique_ptr<Node>> _children; // 静态子节点
+        std::unique_ptr<Node> _param_child;          // 参数捕获子节点
+        std::string _param_name;                     // 参数捕获的名字
+        std::string _wildcard_name;                  // 通配尾部的名字
+        Handler _wildcard_handler;                   // 通配尾部的处理函数，为空表示没有通配尾部
+        Handler _handler;                            // 路径在这里结束时的处理函数
+    };
+    Node _root;
+    std::vector<std::pair<std::regex, Handler>> _regex_routes; // 需要正则表达式的路由
+
+private:
+    // 在node下面插入一段静态路径，返回静态路径结束位置对应的节点
+    static Node *InsertStatic(Node *node, const std::string &path)
+    {
+        size_t pos = 0;
+        while (pos < path.size())
+        {
+            size_t idx = node->_indices.find(path[pos]);
+            if (idx == std::string::npos)
+            {
+                // 没有相同首字符的子节点，直接新建
+                std::unique_ptr<Node> child(new Node);
+                child->_path = path.substr(pos);
+                Node *ret = child.get();
+                node->_indices.push_back(path[pos]);
+                node->_children.push_back(std::move(child));
+                return ret;
+            }
+            Node *child = node->_children[idx].get();
+            size_t common = 0;
+            while (common < child->_path.size() && pos + common < path.size() && child->_path[common] == path[pos + common])
+                ++common;
+            if (common < child->_path.size())
+            {
+                // 公共前缀比子节点的片段短，把子节点拆成公共前缀和剩余部分两个节点
+                std::unique_ptr<Node> split(new Node);
+                split->_path = child->_path.substr(0, common);
+                child->_path.erase(0, common);
+                split->_indices.push_back(child->_path[0]);
+                split->_children.push_back(std::move(node->_children[idx]));
+                node->_children[idx] = std::move(split);
+                child = node->_children[idx].get();
+            }
+            node = child;
+            pos += common;
+        }
+        return node;
+    }
+    void Insert(const std::string &pattern, const Handler &handler)
+    {
+        Node *node = &_root;
+        size_t pos = 0;
+        while (pos < pattern.size())
+        {
+            if (pattern[pos] == ':')
+            {
+                size_t end = pattern.find('/', pos);
+                if (end == std::string::npos)
+                    end = pattern.size();
+                std::string name = pattern.substr(pos + 1, end - pos - 1);
+                if (node->_param_child == nullptr)
+                {
+                    node->_param_child.reset(new Node);
+                    node->_param_name = name;
+                }
+                else if (node->_param_name != name)
+                {
+                    LOG(ERROR, "route %s conflicts with param :%s", pattern.c_str(), node->_param_name.c_str());
+                    abort();
+                }
+                node = node->_param_child.get();
+                pos = end;
+            }
+            else if (pattern[pos] == '*')
+            {
+                node->_wildcard_name = pattern.substr(pos + 1);
+                node->_wildcard_handler = handler;
+                return;
+            }
+            else
+            {
+                size_t end = pattern.find_first_of(":*", pos);
+                if (end == std::string::npos)
+                    end = pattern.size();
+                node = InsertStatic(node, pattern.substr(pos, end - pos));
+                pos = end;
+            }
+        }
+        node->_handler = handler;
+    }
+    static const Handler *Match(const Node *node, const std::string &path, size_t pos, HttpRequest &req)
+    {
+        if (pos == path.size() && node->_handler)
+            return &node->_handler;
+        // 1. 静态子节点，首字符相同的最多只有一个
+        if (pos < path.size())
+        {
+            size_t idx = node->_indices.find(path[pos]);
+            if (idx != std::string::npos)
+            {
+                const Node *child = node->_children[idx].get();
+                if (path.compare(pos, child->_path.size(), child->_path) == 0)
+                {
+                    const Handler *ret = Match(child, path, pos + child->_path.size(), req);
+                    if (ret != nullptr)
+                        return ret;
+                }
+            }
+        }
+        // 2. 参数捕获，匹配到下一个'/'为止
+        if (node->_param_child != nullptr && pos < path.size() && path[pos] != '/')
+        {
+            size_t end = path.find('/', pos);
+            if (end == std::string::npos)
+                end = path.size();
+            req._route_params.push_back(std::make_pair(StrView(node->_param_name), StrView(path.data() + pos, end - pos)));
+            const Handler *ret = Match(node->_param_child.get(), path, end, req);
+            if (ret != nullptr)
+                return ret;
+            req._route_params.pop_back();
+        }
+        // 3. 通配尾部
+        if (node->_wildcard_handler)
+        {
+            req._route_params.push_back(std::make_pair(StrView(node->_wildcard_name), StrView(path.data() + pos, path.size() - pos)));
+            return &node->_wildcard_handler;
+        }
+        return nullptr;
+    }
+
+public:
+    // 规则中包含正则表达式的元字符，或者*不是出现在一个路径段的开头，就只能用正则表达式匹配（'.'当作普通字符）
+    static bool NeedRegex(const std::string &pattern)
+    {
+        if (pattern.find_first_of("()[]{}\\^$|+?") != std::string::npos)
+            return true;
+        size_t star = pattern.find('*');
+        if (star == std::string::npos)
+            return false;
+        return star == 0 || pattern[star - 1] != '/' || pattern.find_first_of("/*:", star + 1) != std::string::npos;
+    }
+    void Add(const std::string &pattern, const Handler &handler)
+    {
+        if (NeedRegex(pattern))
+            _regex_routes.push_back(std::make_pair(std::regex(pattern), handler));
+        else
+            Insert(pattern, handler);
+    }
+    // 查找并调用处理函数，没有匹配的路由返回false；按照解码后的路径匹配
+    bool Dispatch(HttpRequest &req, HttpResponse &rsp) const
+    {
+        req.DecodePath();
+        const Handler *handler = Match(&_root, req._path, 0, req);
+        if (handler != nullptr)
+        {
+            (*handler)(req, rsp);
+            return true;
+        }
+        for (auto &route : _regex_routes)
+        {
+            if (std::regex_match(req._path, req._match, route.first))
+            {
+                route.second(req, rsp);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
 const static int DEFAULT_TIMEOUT = 10; // HTTP默认请求超时时间
 /**
  * HttpServer：封装上面的接口，能够提供一个快速构建http服务器的组件
 */
 class HttpServer
 {
-    using Handler = std::function<void(const HttpRequest &, HttpResponse &)>;
-    using Handlers = std::vector<std::pair<std::regex, Handler>>;
+    using Handler = HttpRouter::Handler;
+    using Handlers = HttpRouter;
 
 private:
     TcpServer _server;      // TcpServer对象
@@ -772,33 +1257,55 @@ private:
     Handlers _post_route;
     Handlers _put_route;
     Handlers _delete_route;
+    bool _lazy_request;     // 零拷贝模式：路由之前不填充请求的字符串成员
 
 private:
     // 组织http协议响应并发送
-    void WriteResponse(const PtrConnection &conn, HttpRequest &req, HttpResponse &rsp)
+    void WriteResponse(const PtrConnection &conn, HttpRequest &req, HttpResponse &rsp, std::string &head)
     {
         // 1. 完善头部字段
-        if (req.KeepAlive() == false) // 设置Connection状态
+        if (req.KeepAlive() == false || conn->Draining()) // 设置Connection状态，服务器退出的时候不再保持长连接
             rsp.SetHeader("Connection", "close");
         else
             rsp.SetHeader("Connection", "keep-alive");
+        if (rsp.HaveFile() && rsp.HaveHeader("Content-Length") == false)
+            rsp.SetHeader("Content-Length", std::to_string(rsp._file_size)); // 文件正文，设置Content-Length
         if (rsp._body.empty() == false && rsp.HaveHeader("Content-Length") == false)
             rsp.SetHeader("Content-Length", std::to_string(rsp._body.size())); // 正文存在，设置Content-Length
         if (rsp._body.empty() == false && rsp.HaveHeader("Content-Type") == false)
             rsp.SetHeader("Content-Type", "application/octet-stream"); // 设置Content-Type
         if (rsp._rediret_flag == true)
             rsp.SetHeader("Location", rsp._rediret_url); // 设置转发
-        // 2. 将rsp中的要素，按照http协议格式组织
-        std::stringstream rsp_str;
-        rsp_str << req._version << " " << std::to_string(rsp._status_code) << " " << Util::GetStatusCodeDesc(rsp._status_code) << "\r\n";
+        // 2. 将rsp中的要素，按照http协议格式组织头部，正文单独作为一个数据段；head是连接复用的缓冲区
+        StrView version = req.Version();
+        head.clear();
+        head.append(version.Data(), version.Size());
+        head += " ";
+        head += std::to_string(rsp._status_code);
+        head += " ";
+        head += Util::GetStatusCodeDesc(rsp._status_code);
+        head += "\r\n";
         for (auto &h : rsp._headers)
         {
-            rsp_str << h.first << ": " << h.second << "\r\n";
+            head += h.first;
+            head += ": ";
+            head += h.second;
+            head += "\r\n";
+        }
+        head += "\r\n";
+        // 3. 发送数据，头部和正文聚集写出，不需要拼接
+        struct iovec iov[2];
+        iov[0].iov_base = &head[0];
+        iov[0].iov_len = head.size();
+        iov[1].iov_base = &rsp._body[0];
+        iov[1].iov_len = rsp._body.size();
+        conn->SendV(iov, rsp._body.empty() ? 1 : 2);
+        // 4. 文件正文交给连接用sendfile发送，HEAD请求只需要头部
+        if (rsp.HaveFile() && req.Method().Equal("HEAD") == false)
+        {
+            uint64_t fsize = rsp._file_size;
+            conn->SendFile(rsp.ReleaseFile(), 0, fsize);
         }
-        rsp_str << "\r\n";
-        rsp_str << rsp._body;
-        // 3. 发送数据
-        conn->Send(rsp_str.str().c_str(), rsp_str.str().size());
     }
     // 判断请求是否是静态资源请求
     bool IsFileHandler(const HttpRequest &req)
@@ -807,7 +1314,8 @@ private:
         if (_base_path.empty())
             return false;
         // 2. 请求方法必须是GET/ HEAD方法
-        if (req._method != "GET" && req._method != "HEAD")
+        StrView method = req.Method();
+        if (method.Equal("GET") == false && method.Equal("HEAD") == false)
             return false;
         // 3. 判断必须是合法路径
         if (Util::IsValidPath(req._path) == false)
@@ -831,28 +1339,15 @@ private:
         {
             req_path += "index.html";
         }
-        bool ret = Util::ReadFile(req_path, rsp._body);
-        if (ret == false)
-            return;
-        std::string mime = Util::GetFileMime(req_path);
-        rsp.SetHeader("Content-Type", mime);
+        // 这里只打开文件，文件内容在发送的时候用sendfile直接发送，不读入内存
+        rsp.SetFile(req_path, Util::GetFileMime(req_path));
     }
     // 功能性请求的分类处理
     void Dispatcher(HttpRequest &req, HttpResponse &rsp, Handlers &handlers)
     {
-        // 在对应的请求方法中查找对应资源的请求处理函数，如果找到就调用，否则就返回404
-        // 实现思路：路由表中存放的就是键值对 正则表达式-处理函数
-        // 使用正则表达式对请求的资源路径进行匹配，如果成功，就调用对应的函数处理，
-        for (auto &handler : handlers)
-        {
-            const std::regex &reg = handler.first;
-            const Handler &functor = handler.second;
-            bool ret = std::regex_match(req._path, req._match, reg);
-            if (ret == false)
-                continue;
-            return functor(req, rsp); // 调用函数处理请求
-        }
-        rsp._status_code = 404; // not found
+        // 在对应的请求方法的路由表中查找对应资源的请求处理函数，如果找到就调用，否则就返回404
+        if (handlers.Dispatch(req, rsp) == false)
+            rsp._status_code = 404; // not found
     }
     // 请求的路由
     void Route(HttpRequest &req, HttpResponse &rsp)
@@ -861,19 +1356,22 @@ private:
         //      静态资源请求就调用FileHandler处理
         //      功能性请求就调用Dispatcher分类处理
         //      如果都不是就出错，返回错误处理（404）
+        //      资源路径解码到请求复用的_path中，请求方法直接比较视图
+        req.DecodePath();
         if (IsFileHandler(req))
         {
             // 是静态资源请求
             return FileHandler(req, rsp);
         }
         // 如果能走到这里，表示可能是功能性请求
-        if (req._method == "GET" || req._method == "HEAD")
+        StrView method = req.Method();
+        if (method.Equal("GET") || method.Equal("HEAD"))
             return Dispatcher(req, rsp, _get_route);
-        else if (req._method == "POST")
+        else if (method.Equal("POST"))
             return Dispatcher(req, rsp, _post_route);
-        else if (req._method == "PUT")
+        else if (method.Equal("PUT"))
             return Dispatcher(req, rsp, _put_route);
-        else if (req._method == "DELETE")
+        else if (method.Equal("DELETE"))
             return Dispatcher(req, rsp, _delete_route);
         rsp._status_code = 405; // 请求方法不支持
     }
@@ -913,12 +1411,13 @@ private:
             //      2. 解析成功就进行路由处理
             context->RecvHttpRequest(buffer);
             HttpRequest &request = context->Request();
-            HttpResponse response(context->ResponseStatu());
+            HttpResponse &response = context->Response(); // 连接复用的响应对象，上一个请求处理完时已经重置
+            response._status_code = context->ResponseStatu();
             if (context->ResponseStatu() >= 400)
             {
                 // 进行错误响应，关闭连接
-                ErrorHandle(request, response);         // 错误响应处理
-                WriteResponse(conn, request, response); // 发送错误响应
+                ErrorHandle(request, response);                                  // 错误响应处理
+                WriteResponse(conn, request, response, context->ResponseHead()); // 发送错误响应
                 context->Reset();                       // 重置上下文
                 buffer->MoveReadOffset(buffer->ReadableSize()); // 出错了就直接清空缓冲区
                 conn->Shutdown();                       // 关闭连接
@@ -929,53 +1428,72 @@ private:
                 // 如果解析不完整，就继续等待
                 return;
             }
-            // 3. 请求路由 + 业务处理
+            // 3. 请求路由 + 业务处理，路由直接使用视图和解码后的路径；默认先填充字符串成员，处理函数可以直接访问
+            if (_lazy_request == false)
+                request.Materialize();
             Route(request, response);
             // 4. 组织response并发送
-            WriteResponse(conn, request, response);
-            // 5. 重置上下文
+            WriteResponse(conn, request, response, context->ResponseHead());
+            // 5. 请求已经处理完，从缓冲区中移除请求数据，重置上下文（响应也一起重置，先记下是否是长连接）
+            bool keep_alive = response.KeepAlive();
+            buffer->MoveReadOffset(context->RequestSize());
             context->Reset();
             // 6. 通过长短连接判断是否要关闭
-            if (response.KeepAlive() == false)
+            if (keep_alive == false)
                 conn->Shutdown(); // 如果是短连接，就直接关闭
         }
     }
 
 public:
-    HttpServer(uint16_t port, int timeout = DEFAULT_TIMEOUT) : _server(port)
+    HttpServer(uint16_t port, int timeout = DEFAULT_TIMEOUT, PollerType poller = POLLER_EPOLL, AcceptMode accept_mode = ACCEPT_SINGLE)
+        : _server(port, -1, poller, accept_mode), _lazy_request(false)
     {
         _server.EnableInactiveRelease(timeout);
         _server.SetConnectedCallback(std::bind(&HttpServer::OnConnection, this, std::placeholders::_1));
         _server.SetMessageCallback(std::bind(&HttpServer::OnMessage, this, std::placeholders::_1, std::placeholders::_2));
     }
+    /* 零拷贝模式，Listen之前调用：请求的字符串成员（_method、_headers、_params、_body等）不再填充，
+       处理函数只能通过Method()/Path()/Query()/Body()/HeaderView()/GetParam()等接口读取，常见的GET请求处理过程中不申请内存 */
+    void EnableLazyRequest(bool on = true) { _lazy_request = on; }
     void SetBasePath(const std::string &path)
     {
         assert(Util::IsDirectory(path) == true);
         _base_path = path;
     }
-    // 设置/添加 请求（请求的正则表达式） 与处理映射的关系
+    // 设置/添加 请求（路由规则，见HttpRouter） 与处理映射的关系
     void Get(const std::string &pattern, const Handler handler)
     {
-        _get_route.push_back(std::make_pair(std::regex(pattern), handler));
+        _get_route.Add(pattern, handler);
     }
     void Post(const std::string &pattern, const Handler handler)
     {
-        _post_route.push_back(std::make_pair(std::regex(pattern), handler));
+        _post_route.Add(pattern, handler);
     }
     void Put(const std::string &pattern, const Handler handler)
     {
-        _put_route.push_back(std::make_pair(std::regex(pattern), handler));
+        _put_route.Add(pattern, handler);
     }
     void Delete(const std::string &pattern, const Handler handler)
     {
-        _delete_route.push_back(std::make_pair(std::regex(pattern), handler));
+        _delete_route.Add(pattern, handler);
     }
-    void SetThreadNum(int num)
+    void SetThreadNum(int num) // 从属线程个数，默认使用CPU核数，Listen之前调用
     {
         _server.SetThreadNum(num);
     }
-    void Listen()
+    int LoopCount() { return _server.LoopCount(); } // 实际处理连接的loop个数
+    void SetLoadBalancer(LoadBalance type) { _server.SetLoadBalancer(type); } // 新连接分给从属线程的策略，Listen之前调用
+    // 定期把空闲的长连接从连接多的loop迁移到连接少的loop，Listen之前调用
+    void EnableRebalance(uint32_t interval, int64_t threshold = 2, uint32_t batch = 16) { _server.EnableRebalance(interval, threshold, batch); }
+    TcpServer::MigrationStats GetMigrationStats() { return _server.GetMigrationStats(); }
+    void Listen() // 调用Stop之后返回
     {
         _server.Start();
     }
+    // 优雅退出，可以在任意线程调用：不再接收新连接，正在处理的请求处理完之后关闭连接，超过deadline毫秒的强制关闭
+    void Stop(uint32_t deadline)
+    {
+        _server.Stop(deadline);
+    }
+    TcpServer::StopStats GetStopStats() { return _server.GetStopStats(); }
 };
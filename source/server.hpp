@@ -23,10 +23,31 @@
 #include <sys/eventfd.h>
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(IORING_POLL_ADD_MULTI) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1 // 编译环境的内核头文件支持io_uring（多次触发的poll需要5.13以上）
+#if defined(IORING_RECV_MULTISHOT)
+#define HAVE_IO_URING_MULTISHOT 1 // 多次触发的accept/recv和提供缓冲区的环（6.0以上）
+#endif
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <ctime>
 #include <cstdio>
@@ -37,14 +58,17 @@
 
 #include <iostream>
 #include <vector>
+#include <deque>
 #include <string>
 #include <unordered_map>
 #include <functional>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <atomic>
 #include <memory>
 #include <utility>
+#include <algorithm>
 #include <typeinfo>
 
 /**
@@ -159,24 +183,262 @@ private: // 类内成员变量
 };
 
 /**
- * Buffer类是用来管理缓冲区的，内部使用一个vector容器来存放内容
+ * ByteScanner：在一段内存中查找两个字节中任意一个第一次出现的位置，用于协议解析时一遍扫描同时找到换行和分隔符
+ * 编译时开启了AVX2就一次比较32个字节，否则使用SSE2一次比较16个字节，都不支持的平台使用逐字节比较
+ * 只查找一个字节的时候直接用memchr，libc里面的实现已经是向量化的了
+ */
+class ByteScanner
+{
+public:
+    static const char *FindEither(const char *p, const char *end, char a, char b)
+    {
+#if defined(__AVX2__)
+        const __m256i va = _mm256_set1_epi8(a);
+        const __m256i vb = _mm256_set1_epi8(b);
+        for (; p + 32 <= end; p += 32)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+            uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+            if (mask != 0)
+                return p + __builtin_ctz(mask);
+        }
+#endif
+#if defined(__SSE2__)
+        const __m128i xa = _mm_set1_epi8(a);
+        const __m128i xb = _mm_set1_epi8(b);
+        for (; p + 16 <= end; p += 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            uint32_t mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, xa), _mm_cmpeq_epi8(v, xb)));
+            if (mask != 0)
+                return p + __builtin_ctz(mask);
+        }
+#endif
+        for (; p < end; ++p)
+        {
+            if (*p == a || *p == b)
+                return p;
+        }
+        return nullptr;
+    }
+    static const char *FindByte(const char *p, const char *end, char c)
+    {
+        if (p >= end)
+            return nullptr;
+        return static_cast<const char *>(memchr(p, c, end - p));
+    }
+};
+
+/**
+ * BufferPool：缓冲区内存块池，Buffer的存储空间从池中租用，Buffer销毁或者扩容的时候再归还给池
+ * 内存块按照2的幂次划分大小等级（1KB~1MB），每个等级维护一个空闲链表，更大的内存块直接申请和释放
+ * 每个EventLoop拥有一个自己的池，并且只在自己的线程中使用，所以不需要任何锁；没有EventLoop的线程使用线程局部的默认池
+ * 内存块可以在一个池中租用、在另一个池中归还，因为所有池的大小等级是一样的；
+ * 但是连接对象最后是在主线程中析构的，所以连接释放（以及迁移）的时候在所在的loop中先把缓冲区归还，不让内存块都堆到主线程的池里
+ * 池中缓存的空闲内存超过高水位之后，归还的内存块直接释放，不再缓存
+ */
+const static int MinChunkShift = 10;                  // 最小的内存块1KB
+const static int MaxChunkShift = 20;                  // 能够被缓存的最大内存块1MB
+const static uint64_t DefaultPoolHighWater = 8 << 20; // 每个池默认最多缓存8MB的空闲内存
+class BufferPool
+{
+public:
+    struct Stats
+    {
+        uint64_t hits;           // 从空闲链表中直接拿到内存块的次数
+        uint64_t misses;         // 需要重新申请内存的次数
+        uint64_t trims;          // 超过高水位直接释放的次数
+        uint64_t resident_bytes; // 当前缓存的空闲内存大小
+    };
+
+private:
+    std::vector<char *> _free[MaxChunkShift - MinChunkShift + 1]; // 每个大小等级的空闲内存块
+    uint64_t _high_water;                                          // 缓存空闲内存的上限
+    Stats _stats;
+
+private:
+    static BufferPool *&CurrentRef()
+    {
+        static thread_local BufferPool *current = nullptr;
+        return current;
+    }
+    static int SizeClass(uint64_t size) // 能容纳size的最小等级
+    {
+        int shift = MinChunkShift;
+        while ((1ull << shift) < size)
+            ++shift;
+        return shift - MinChunkShift;
+    }
+
+public:
+    BufferPool() : _high_water(DefaultPoolHighWater) { memset(&_stats, 0, sizeof(_stats)); }
+    ~BufferPool() { Trim(0); }
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+    // 当前线程使用的池，线程已经退出的时候返回nullptr
+    static BufferPool *Current();
+    static bool &DefaultDestroyed() // 线程退出时默认池已经析构，之后归还的内存直接释放
+    {
+        static thread_local bool destroyed = false;
+        return destroyed;
+    }
+    // EventLoop构造的时候设置为自己的池，析构的时候恢复
+    static void SetCurrent(BufferPool *pool) { CurrentRef() = pool; }
+    static bool IsCurrent(BufferPool *pool) { return CurrentRef() == pool; }
+
+    // 租用一块至少size大小的内存，实际大小通过capacity返回
+    char *Lease(uint64_t size, uint64_t *capacity)
+    {
+        if (size > (1ull << MaxChunkShift))
+        {
+            *capacity = size;
+            ++_stats.misses;
+            return static_cast<char *>(::operator new(size));
+        }
+        int cls = SizeClass(size);
+        *capacity = 1ull << (cls + MinChunkShift);
+        if (!_free[cls].empty())
+        {
+            char *chunk = _free[cls].back();
+            _free[cls].pop_back();
+            _stats.resident_bytes -= *capacity;
+            ++_stats.hits;
+            return chunk;
+        }
+        ++_stats.misses;
+        return static_cast<char *>(::operator new(*capacity));
+    }
+    // 归还内存块，capacity必须是租用时返回的大小
+    void Return(char *chunk, uint64_t capacity)
+    {
+        if (capacity > (1ull << MaxChunkShift) || _stats.resident_bytes + capacity > _high_water)
+        {
+            if (capacity <= (1ull << MaxChunkShift))
+                ++_stats.trims;
+            ::operator delete(chunk);
+            return;
+        }
+        _free[SizeClass(capacity)].push_back(chunk);
+        _stats.resident_bytes += capacity;
+    }
+    // 释放缓存的空闲内存，直到不超过limit
+    void Trim(uint64_t limit)
+    {
+        for (int cls = MaxChunkShift - MinChunkShift; cls >= 0 && _stats.resident_bytes > limit; --cls)
+        {
+            uint64_t capacity = 1ull << (cls + MinChunkShift);
+            while (!_free[cls].empty() && _stats.resident_bytes > limit)
+            {
+                ::operator delete(_free[cls].back());
+                _free[cls].pop_back();
+                _stats.resident_bytes -= capacity;
+                ++_stats.trims;
+            }
+        }
+    }
+    void SetHighWater(uint64_t bytes)
+    {
+        _high_water = bytes;
+        Trim(bytes);
+    }
+    const Stats &GetStats() const { return _stats; }
+    // 命中率
+    double HitRate() const
+    {
+        uint64_t total = _stats.hits + _stats.misses;
+        return total == 0 ? 0.0 : (double)_stats.hits / total;
+    }
+};
+struct DefaultBufferPool // 没有EventLoop的线程使用的默认池
+{
+    BufferPool pool;
+    ~DefaultBufferPool() { BufferPool::DefaultDestroyed() = true; }
+};
+inline BufferPool *BufferPool::Current()
+{
+    BufferPool *pool = CurrentRef();
+    if (pool != nullptr)
+        return pool;
+    if (DefaultDestroyed())
+        return nullptr;
+    static thread_local DefaultBufferPool holder;
+    return &holder.pool;
+}
+
+/**
+ * Buffer类是用来管理缓冲区的，存储空间是从当前线程的BufferPool中租用的一块连续内存
  * 一直向后填充，当前面的空闲空间+后面的空闲空间足够下次填充的时候就移动元素到最前端
+ * 空间不够时按照至少两倍的大小扩容，避免每次读取都要重新分配一次
+ * 存储空间在第一次写入的时候才租用，这样连接的缓冲区会从连接所在的EventLoop的池中分配
  *
- * 优化方向：使用环形队列的方式优化，可以避免出现移动元素的情况
+ * ReadFd：使用readv一次性读取到缓冲区的可写空间和一块栈上的额外空间中，
+ *        大部分情况下数据直接落在缓冲区里面，只有超出可写空间的部分才需要再拷贝一次
  */
 const static int DefaultBufferSize = 1024;
+const static int ExtraBufferSize = 65536; // ReadFd时栈上额外空间的大小
 class Buffer
 {
 private:
-    std::vector<char> _buffer;
+    char *_buffer;       // 从BufferPool租用的存储空间
+    uint64_t _capacity;  // 存储空间的大小
     uint64_t _read_idx;
     uint64_t _write_idx;
 
+private:
+    static char *LeaseChunk(uint64_t size, uint64_t *capacity)
+    {
+        BufferPool *pool = BufferPool::Current();
+        if (pool != nullptr)
+            return pool->Lease(size, capacity);
+        *capacity = size;
+        return static_cast<char *>(::operator new(size));
+    }
+    static void ReturnChunk(char *chunk, uint64_t capacity)
+    {
+        if (chunk == nullptr)
+            return;
+        BufferPool *pool = BufferPool::Current();
+        if (pool != nullptr)
+            return pool->Return(chunk, capacity);
+        ::operator delete(chunk);
+    }
+    // 更换存储空间，把可读数据搬到新空间的最前面
+    void Reserve(uint64_t size)
+    {
+        uint64_t capacity = 0;
+        char *chunk = LeaseChunk(size, &capacity);
+        uint64_t rsz = ReadableSize();
+        if (rsz > 0)
+            memcpy(chunk, ReadPosition(), rsz);
+        ReturnChunk(_buffer, _capacity);
+        _buffer = chunk;
+        _capacity = capacity;
+        _read_idx = 0;
+        _write_idx = rsz;
+    }
+
 public:
-    Buffer() : _read_idx(0), _write_idx(0), _buffer(DefaultBufferSize) {}
-    ~Buffer() {}
+    Buffer() : _buffer(nullptr), _capacity(0), _read_idx(0), _write_idx(0) {}
+    Buffer(const Buffer &other) : _buffer(nullptr), _capacity(0), _read_idx(0), _write_idx(0)
+    {
+        WriteAndPush(other._buffer + other._read_idx, other.ReadableSize());
+    }
+    Buffer(Buffer &&other) : _buffer(other._buffer), _capacity(other._capacity), _read_idx(other._read_idx), _write_idx(other._write_idx)
+    {
+        other._buffer = nullptr;
+        other._capacity = other._read_idx = other._write_idx = 0;
+    }
+    Buffer &operator=(Buffer other)
+    {
+        std::swap(_buffer, other._buffer);
+        std::swap(_capacity, other._capacity);
+        std::swap(_read_idx, other._read_idx);
+        std::swap(_write_idx, other._write_idx);
+        return *this;
+    }
+    ~Buffer() { ReturnChunk(_buffer, _capacity); }
     // 获取_buffer的起始地址
-    char *Begin() { return &*_buffer.begin(); }
+    char *Begin() { return _buffer; }
     // const char *Begin() const { return &*_buffer.begin(); }
     // 获取当前读取空间地址
     // char *ReadPosition() const { return Begin() + _read_idx; }
@@ -186,7 +448,7 @@ public:
     // 获取前沿空闲空间大小
     uint64_t HeadSize() { return _read_idx; }
     // 获取后续空闲空间大小
-    uint64_t TailSize() { return _buffer.size() - _write_idx; }
+    uint64_t TailSize() { return _capacity - _write_idx; }
     // 获取可读数据大小
     uint64_t ReadableSize() const { return _write_idx - _read_idx; }
     // 读偏移向后移动
@@ -209,6 +471,10 @@ public:
     {
         if (len <= TailSize())
             return;
+        else if (_buffer == nullptr) // 第一次写入，从池中租用存储空间
+        {
+            Reserve(len > (uint64_t)DefaultBufferSize ? len : DefaultBufferSize);
+        }
         else if (len <= HeadSize() + TailSize()) // 移动数据到最前面
         {
             uint64_t rsz = ReadableSize();
@@ -218,8 +484,12 @@ public:
         }
         else // len > HeadSize() + TailSize() // 扩容
         {
-            // 这里的策略就是直接调整_buffer的大小，不拷贝其他现有数据
-            _buffer.resize(_write_idx + len);
+            // 按照几何级数扩容，至少扩大为原来的两倍，减少连续写入时的扩容次数
+            // 换到新的存储空间的时候只搬移可读数据，前沿空闲空间顺便回收
+            uint64_t newsize = _capacity * 2;
+            if (newsize < ReadableSize() + len)
+                newsize = ReadableSize() + len;
+            Reserve(newsize);
         }
     }
     // 读取数据
@@ -279,9 +549,18 @@ public:
         WriteBuffer(data);
         MoveWriteOffset(data.ReadableSize());
     }
+    // 从可读数据的offset位置开始查找换行，前面已经扫描过的数据不再重复扫描
+    char *FindCRLF(uint64_t offset)
+    {
+        if (offset >= ReadableSize())
+            return nullptr;
+        return (char *)memchr(ReadPosition() + offset, '\n', ReadableSize() - offset);
+    }
     char *FindCRLF()
     {
         // std::find(ReadPosition(), ReadPosition() + ReadableSize(), '\n');
+        if (ReadableSize() == 0)
+            return nullptr;
         char *s = (char *)memchr(ReadPosition(), '\n', ReadableSize());
         return s;
     }
@@ -298,8 +577,252 @@ public:
         MoveReadOffset(str.size());
         return str;
     }
+    // 从描述符中读取数据，返回值>0表示读取的字节数，0表示暂时没有数据，-1表示出错或者对端关闭
+    ssize_t ReadFd(int fd)
+    {
+        if (_buffer == nullptr)
+            EnsureWriteSpace(DefaultBufferSize);
+        char extrabuf[ExtraBufferSize];
+        struct iovec vec[2];
+        uint64_t writable = TailSize();
+        vec[0].iov_base = WritePosition();
+        vec[0].iov_len = writable;
+        vec[1].iov_base = extrabuf;
+        vec[1].iov_len = sizeof(extrabuf);
+        // 可写空间已经足够大的时候就不需要额外空间了
+        int iovcnt = (writable < sizeof(extrabuf)) ? 2 : 1;
+        ssize_t n = readv(fd, vec, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            LOG(ERROR, "buffer readv error, code:%d, reason:%s", errno, strerror(errno));
+            return -1;
+        }
+        if (n == 0) // 对端关闭连接
+            return -1;
+        if ((uint64_t)n <= writable)
+        {
+            MoveWriteOffset(n);
+        }
+        else
+        {
+            _write_idx = _capacity;
+            WriteAndPush(extrabuf, n - writable);
+        }
+        return n;
+    }
     // 清空缓冲区
     void Clear() { _read_idx = _write_idx = 0; }
+    // 清空缓冲区并把存储空间归还给当前线程的池，下次写入时再重新租用
+    void Release()
+    {
+        ReturnChunk(_buffer, _capacity);
+        _buffer = nullptr;
+        _capacity = _read_idx = _write_idx = 0;
+    }
+};
+
+/**
+ * OutputQueue类是连接的输出队列，由若干个数据段组成，每个数据段各自保存自己的内容
+ * 发送的时候使用writev把队列前面的多个数据段一次性写入套接字，比如http响应的头部和正文可以作为两个数据段发送，不需要先拼接到一起
+ * 较小的数据追加的时候会合并到最后一个数据段中，避免产生大量的小数据段
+ *
+ * 文件数据段：只记录文件描述符和待发送的范围，轮到它的时候使用sendfile直接从内核发送，文件内容不经过用户态内存
+ * 文件描述符的所有权交给输出队列，发送完毕或者队列销毁的时候关闭
+ *
+ * 数据段的来源：拷贝的数据、接管的std::string、接管的Buffer、共享的只读数据（多个连接可以发送同一份数据）、文件
+ * 除了拷贝的数据以外，其他来源都不会拷贝数据内容，CopiedBytes统计了追加时实际拷贝的字节数
+ */
+const static int MaxWriteIovecs = 64;         // 一次writev最多携带的数据段个数
+const static int SegmentMergeSize = 4096;     // 小于这个大小的数据段允许合并
+const static int MaxSendfileSize = 1 << 20;   // 一次sendfile最多发送的字节数，避免一个连接占用太久
+class OutputQueue
+{
+private:
+    enum SegmentType
+    {
+        SEG_STRING, // 拷贝的数据或者接管的字符串
+        SEG_BUFFER, // 接管的Buffer
+        SEG_SHARED, // 共享的只读数据
+        SEG_FILE    // 文件
+    };
+    struct Segment
+    {
+        SegmentType _type;
+        std::string _data;                          // SEG_STRING保存的内容
+        Buffer _buf;                                // SEG_BUFFER保存的内容
+        std::shared_ptr<const std::string> _shared; // SEG_SHARED引用的内容
+        uint64_t _offset;                           // 内存数据段：已经发送的偏移；文件数据段：下一次发送的文件偏移
+        int _fd;                                    // 文件数据段的描述符
+        uint64_t _remain;                           // 文件数据段剩余待发送的长度
+        Segment(std::string &&data) : _type(SEG_STRING), _data(std::move(data)), _offset(0), _fd(-1), _remain(0) {}
+        Segment(Buffer &&buf) : _type(SEG_BUFFER), _buf(std::move(buf)), _offset(0), _fd(-1), _remain(0) {}
+        Segment(const std::shared_ptr<const std::string> &shared) : _type(SEG_SHARED), _shared(shared), _offset(0), _fd(-1), _remain(0) {}
+        Segment(int fd, uint64_t offset, uint64_t len) : _type(SEG_FILE), _offset(offset), _fd(fd), _remain(len) {}
+        bool IsFile() const { return _type == SEG_FILE; }
+        const char *ReadPosition()
+        {
+            if (_type == SEG_BUFFER)
+                return _buf.ReadPosition() + _offset;
+            if (_type == SEG_SHARED)
+                return _shared->data() + _offset;
+            return _data.data() + _offset;
+        }
+        uint64_t ReadableSize()
+        {
+            if (_type == SEG_FILE)
+                return _remain;
+            if (_type == SEG_BUFFER)
+                return _buf.ReadableSize() - _offset;
+            if (_type == SEG_SHARED)
+                return _shared->size() - _offset;
+            return _data.size() - _offset;
+        }
+    };
+    std::deque<Segment> _segments; // 待发送的数据段
+    uint64_t _size;                // 所有数据段中待发送数据的总长度
+    uint64_t _copied;              // 追加数据时拷贝的总字节数
+
+private:
+    void PopFront()
+    {
+        if (_segments.front().IsFile())
+            close(_segments.front()._fd);
+        _segments.pop_front();
+    }
+    ssize_t SendFile(int fd, Segment &seg)
+    {
+        off_t offset = seg._offset;
+        size_t len = seg._remain < (uint64_t)MaxSendfileSize ? seg._remain : MaxSendfileSize;
+        ssize_t n = sendfile(fd, seg._fd, &offset, len);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            LOG(ERROR, "output queue sendfile error, code:%d, reason:%s", errno, strerror(errno));
+            return -1;
+        }
+        if (n == 0) // 文件被截断了，剩下的内容已经无法发送
+        {
+            LOG(ERROR, "output queue sendfile reach end of file, remain:%lu", seg._remain);
+            return -1;
+        }
+        Consume(n);
+        return n;
+    }
+
+public:
+    OutputQueue() : _size(0), _copied(0) {}
+    ~OutputQueue() { Clear(); }
+    uint64_t ReadableSize() const { return _size; }
+    uint64_t CopiedBytes() const { return _copied; }
+    bool Empty() const { return _size == 0; }
+    // 拷贝一份数据追加到队列尾部
+    void Append(const void *data, uint64_t len)
+    {
+        if (len == 0)
+            return;
+        const char *d = static_cast<const char *>(data);
+        if (!_segments.empty() && _segments.back()._type == SEG_STRING && _segments.back()._data.size() + len <= SegmentMergeSize)
+        {
+            _segments.back()._data.append(d, len); // 合并到最后一个较小的数据段中
+        }
+        else
+        {
+            _segments.push_back(Segment(std::string(d, len)));
+        }
+        _size += len;
+        _copied += len;
+    }
+    // 接管一个字符串作为新的数据段，不拷贝数据
+    void Append(std::string &&data)
+    {
+        if (data.empty())
+            return;
+        _size += data.size();
+        _segments.push_back(Segment(std::move(data)));
+    }
+    // 接管一个Buffer中的可读数据作为新的数据段，不拷贝数据
+    void Append(Buffer &&buf)
+    {
+        if (buf.ReadableSize() == 0)
+            return;
+        _size += buf.ReadableSize();
+        _segments.push_back(Segment(std::move(buf)));
+    }
+    // 引用一份共享的只读数据作为新的数据段，不拷贝数据
+    void Append(const std::shared_ptr<const std::string> &shared)
+    {
+        if (!shared || shared->empty())
+            return;
+        _size += shared->size();
+        _segments.push_back(Segment(shared));
+    }
+    // 追加一个文件数据段，从offset开始发送len个字节，fd的所有权交给输出队列
+    void AppendFile(int fd, uint64_t offset, uint64_t len)
+    {
+        if (len == 0)
+        {
+            close(fd);
+            return;
+        }
+        _size += len;
+        _segments.push_back(Segment(fd, offset, len));
+    }
+    // 丢弃队列前面已经发送的len个字节
+    void Consume(uint64_t len)
+    {
+        assert(len <= _size);
+        _size -= len;
+        while (len > 0)
+        {
+            Segment &seg = _segments.front();
+            uint64_t rsz = seg.ReadableSize();
+            if (len < rsz)
+            {
+                seg._offset += len;
+                if (seg.IsFile())
+                    seg._remain -= len;
+                return;
+            }
+            len -= rsz;
+            PopFront();
+        }
+    }
+    // 把队列中的数据写入描述符，返回值>0表示写入的字节数，0表示暂时不可写，-1表示出错
+    ssize_t WriteFd(int fd)
+    {
+        if (_size == 0)
+            return 0;
+        if (_segments.front().IsFile())
+            return SendFile(fd, _segments.front());
+        // 收集队列前面连续的内存数据段，遇到文件数据段就停下，留给下一次发送
+        struct iovec vec[MaxWriteIovecs];
+        int iovcnt = 0;
+        for (auto it = _segments.begin(); it != _segments.end() && !it->IsFile() && iovcnt < MaxWriteIovecs; ++it)
+        {
+            vec[iovcnt].iov_base = const_cast<char *>(it->ReadPosition());
+            vec[iovcnt].iov_len = it->ReadableSize();
+            ++iovcnt;
+        }
+        ssize_t n = writev(fd, vec, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            LOG(ERROR, "output queue writev error, code:%d, reason:%s", errno, strerror(errno));
+            return -1;
+        }
+        Consume(n);
+        return n;
+    }
+    void Clear()
+    {
+        while (!_segments.empty())
+            PopFront();
+        _size = 0;
+    }
 };
 
 /**
@@ -357,7 +880,7 @@ public:
         struct sockaddr_in peer;
         socklen_t len = sizeof(peer);
         int newsock = accept(_sockfd, (struct sockaddr *)&peer, &len);
-        if (newsock < 0)
+        if (newsock < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
         {
             LOG(ERROR, "accept socket error, code: %d, reson: %s", errno, strerror(errno));
             return false;
@@ -371,7 +894,8 @@ public:
         struct sockaddr_in peer;
         socklen_t len = sizeof(peer);
         int newsock = accept(_sockfd, (struct sockaddr *)&peer, &len);
-        if (newsock < 0)
+        // 多个线程监控同一个监听套接字时，连接可能已经被别的线程取走，EAGAIN不是错误
+        if (newsock < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
         {
             LOG(ERROR, "accept socket error, code: %d, reson: %s", errno, strerror(errno));
         }
@@ -424,6 +948,7 @@ public:
             LOG(ERROR, "socket send error, code:%d, reason:%s", errno, strerror(errno));
             return -1;
         }
+        return n;
     }
     ssize_t NonBlockRecv(void *buf, size_t len)
     {
@@ -435,6 +960,18 @@ public:
             return 0;
         return Send(buf, len, MSG_DONTWAIT);
     }
+    ssize_t NonBlockSendV(const struct iovec *iov, int iovcnt) // 聚集写，套接字需要已经设置为非阻塞
+    {
+        ssize_t n = writev(_sockfd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            LOG(ERROR, "socket writev error, code:%d, reason:%s", errno, strerror(errno));
+            return -1;
+        }
+        return n;
+    }
     void Close()
     {
         if (_sockfd != -1)
@@ -447,7 +984,17 @@ public:
     bool NonBlack() // 设置非阻塞
     {
         int flag = fcntl(_sockfd, F_GETFL, 0);
-        fcntl(_sockfd, F_SETFL, flag | O_NONBLOCK);
+        return fcntl(_sockfd, F_SETFL, flag | O_NONBLOCK) == 0;
+    }
+    bool BusyPoll(uint32_t usec) // 设置SO_BUSY_POLL，读取时没有数据先在网卡队列上忙等usec微秒（超过net.core.busy_read需要CAP_NET_ADMIN）
+    {
+#ifdef SO_BUSY_POLL
+        int opt = usec;
+        if (setsockopt(_sockfd, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof(opt)) == 0)
+            return true;
+        LOG(DEBUG, "设置SO_BUSY_POLL失败, code: %d, reason: %s", errno, strerror(errno));
+#endif
+        return false;
     }
     bool ReuseAddress() // 设置端口重用
     {
@@ -463,23 +1010,26 @@ public:
             LOG(DEBUG, "设置端口和地址重用失败");
             return false;
         }
-        n = setsockopt(_sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
-        if (n == 0)
-        {
-            // LOG(DEBUG, "设置端口和地址重用成功");
-            return true;
-        }
-        else
+    }
+    // 允许多个套接字绑定同一个端口，内核按四元组哈希把新连接分给其中一个监听套接字，需要在Bind之前设置
+    bool ReusePort()
+    {
+        int opt = 1;
+        int n = setsockopt(_sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+        if (n < 0)
         {
-            LOG(DEBUG, "设置端口和地址重用失败");
+            LOG(ERROR, "设置SO_REUSEPORT失败, code: %d, reson: %s", errno, strerror(errno));
             return false;
         }
+        return true;
     }
-    bool CreateServer(uint16_t port, const std::string &ip = "0.0.0.0", bool block_flag = false)
+    bool CreateServer(uint16_t port, const std::string &ip = "0.0.0.0", bool block_flag = false, bool reuse_port = false)
     {
         if (Create() == false)
             return false;
         ReuseAddress();
+        if (reuse_port && ReusePort() == false)
+            return false;
         if (Bind(port, ip) == false)
             return false;
         if (Listen() == false)
@@ -509,26 +1059,51 @@ public:
  *  2. 设置各种回调函数
  *  3. 对监控的事件进行控制，包括添加、删除、修改
  */
+// 完成式的读：Poller支持的时候（io_uring的多次触发accept/recv），由Poller直接接收新连接或者数据，
+// 结果放在Channel中，再和可读事件一样调用读回调，读回调从Completions中取出结果，不再自己调用accept/recv
+enum CompletionMode
+{
+    COMPLETION_NONE,   // 只通知可读，由读回调自己读取
+    COMPLETION_ACCEPT, // 监听套接字，Poller接收新连接
+    COMPLETION_RECV    // 连接套接字，Poller接收数据
+};
 class Channel
 {
     using EventCallback = std::function<void()>; // 回调函数类型
 
+public:
+    struct Completion
+    {
+        int _res;          // 新连接的描述符，或者收到的字节数（0表示对端关闭，小于0是错误码的相反数）
+        const char *_data; // 收到的数据，在Poller的缓冲区中，只在这一轮事件处理中有效
+    };
+
 private:
     int _fd;
     uint32_t _events;
     uint32_t _revents;
     EventLoop *_loop;
+    CompletionMode _completion;           // 读的方式
+    std::vector<Completion> _completions; // 这一轮的完成结果，事件处理完之后清空，容量复用
     EventCallback _read_callback;   // 可读事件被触发的回调函数
     EventCallback _write_callback;  // 可写事件被触发的回调函数
     EventCallback _except_callback; // 异常事件被触发的回调函数
     EventCallback _close_callback;  // 连接断开事件被触发的回调函数
     EventCallback _event_callback;  // 任意事件被触发的回调函数
 public:
-    Channel(int fd, EventLoop *loop) : _fd(fd), _loop(loop) {}
-    ~Channel() { close(_fd); }
+    Channel(int fd, EventLoop *loop) : _fd(fd), _events(0), _revents(0), _loop(loop), _completion(COMPLETION_NONE) {}
+    // 连接迁移到另一个loop时调用，需要先从原来的loop中移除监控，再在新的loop线程中重新添加
+    void SetLoop(EventLoop *loop) { _loop = loop; }
+    ~Channel() {} // 描述符由它的所有者（Socket、EventLoop、TimerWheel）关闭，这里再关闭可能会关掉已经被复用的描述符
     int Fd() { return _fd; }
     int Events() { return _events; } // 获取关心的events
+    uint32_t Revents() { return _revents; }
     void SetRevents(uint32_t events) { _revents = events; }
+    // 设置完成式的读，需要在开启读监控之前在EventLoop线程中调用；Poller不支持的时候返回false，继续使用可读事件
+    bool SetCompletion(CompletionMode mode);
+    CompletionMode GetCompletion() { return _completion; }
+    void AddCompletion(int res, const char *data) { _completions.push_back(Completion{res, data}); }
+    const std::vector<Completion> &Completions() { return _completions; }
     void SetReadCallback(const EventCallback &cb) { _read_callback = cb; }
     void SetWriteCallback(const EventCallback &cb) { _write_callback = cb; }
     void SetExceptCallback(const EventCallback &cb) { _except_callback = cb; }
@@ -537,6 +1112,23 @@ public:
 
     bool Readable() { return (_events & EPOLLIN); }
     bool Writeable() { return (_events & EPOLLOUT); }
+    bool EdgeTriggered() { return (_events & EPOLLET); }
+    // 设置边缘触发，需要在开启事件监控之前设置
+    void SetEdgeTriggered(bool on)
+    {
+        if (on)
+            _events |= EPOLLET;
+        else
+            _events &= ~EPOLLET;
+    }
+    // 设置EPOLLEXCLUSIVE：多个epoll实例监控同一个fd时，事件到来只唤醒其中一个，避免惊群
+    // 只能在第一次开启事件监控(EPOLL_CTL_ADD)之前设置，之后不能再修改事件(EPOLL_CTL_MOD会返回EINVAL)
+    void SetExclusive()
+    {
+#ifdef EPOLLEXCLUSIVE
+        _events |= EPOLLEXCLUSIVE;
+#endif
+    }
 
     void EnableRead() // 开启可读
     {
@@ -562,9 +1154,9 @@ public:
     }
     void DisableAll()
     {
-        _events = 0;
+        _events &= EPOLLET;
         Update();
-    } // 关闭所有事件监控
+    } // 关闭所有事件监控，保留触发方式
 
     // 这里由于会调用Poller类中的成员函数，在当前类里面无法得知Poller类中有什么成员，所以需要在类外面进行实现，所以这里只给出声明
     void Remove(); // 函数声明，移除监控
@@ -581,6 +1173,12 @@ public:
                 _read_callback();
         }
         // 这里的操作中，有可能会出现释放连接的操作，所以一次就只处理一个事件
+        // 边缘触发的时候可读可写同时就绪只会通知这一次，所以读完之后还要处理写（连接的释放是压入任务池执行的，这里对象还存在）
+        if ((_revents & EPOLLOUT) && (_events & EPOLLET) && (_revents & (EPOLLIN | EPOLLRDHUP | EPOLLPRI)))
+        {
+            if (_write_callback)
+                _write_callback();
+        }
         else if (_revents & EPOLLOUT)
         {
             // LOG(DEBUG, "这是一个写事件");
@@ -601,12 +1199,40 @@ public:
         }
         if (_event_callback)
                 _event_callback();
+        _completions.clear(); // 数据所在的缓冲区下一轮会还给内核
     }
 };
 
 /**
- * Poller模块：对整个epoll模型的封装，同时管理监听套接字的事件的指针（通过套接字描述符映射）
+ * Poller模块：事件监控的接口，EventLoop只通过这几个接口添加/修改/移除监控和获取就绪的Channel
+ * 有epoll和io_uring两种实现，创建EventLoop的时候选择，io_uring不可用的时候自动使用epoll
+ */
+enum PollerType
+{
+    POLLER_EPOLL,   // epoll
+    POLLER_IO_URING // io_uring，不可用的时候退回epoll
+};
+class Poller
+{
+public:
+    virtual ~Poller() {}
+    virtual void UpdateEvent(Channel *channel) = 0; // 添加/修改监控事件
+    virtual void RemoveEvent(Channel *channel) = 0; // 移除监控事件
+    // 开始监控，返回活跃连接（追加到actions中，调用者负责清空，这样数组的容量可以复用）
+    // timeout为0时只取已经就绪的事件，不阻塞；为-1时一直等到有事件就绪
+    virtual void Poll(std::vector<Channel *> *actions, int timeout) = 0;
+    virtual PollerType Type() = 0;
+    // 是否支持完成式的读（见CompletionMode），支持的Poller对这样的Channel不再监控可读，而是直接接收
+    virtual bool SupportCompletion(CompletionMode /*mode*/) { return false; }
+    // 创建指定类型的Poller，不可用的时候返回epoll的实现
+    static Poller *Create(PollerType type);
+};
+
+/**
+ * EpollPoller模块：对整个epoll模型的封装，同时管理监听套接字的事件的指针（通过套接字描述符映射）
  * 实现思路：
+ *  epoll_event.data.ptr中直接保存Channel指针，就绪事件不需要再查表就能找到对应的Channel
+ *  描述符是从小到大分配的，所以用按描述符下标的数组记录添加过的Channel，只在添加/移除的时候使用
  *
  * 理论上全局就一个Poller对象，但是为了方便，这里暂时没有设置单例模式，后面可以添加
  * 提供的功能：
@@ -615,19 +1241,19 @@ public:
  *  3. 添加/更新、移除监控事件
  *  4. 监控事件，并将就绪事件的返回
  */
-class Poller
+class EpollPoller : public Poller
 {
 private:
     int _epfd;
     struct epoll_event _evs[MAX_EPOLLEVENTS];
-    std::unordered_map<int, Channel *> _channels;
+    std::vector<Channel *> _channels; // 按描述符下标记录添加过的Channel，没有添加的位置为nullptr
 
 private:
     void Update(Channel *channel, int op) // 对epoll模型直接操作
     {
         int fd = channel->Fd();
         struct epoll_event ev;
-        ev.data.fd = fd;
+        ev.data.ptr = channel;
         ev.events = channel->Events();
         int n = epoll_ctl(_epfd, op, fd, &ev);
         if (n < 0)
@@ -637,12 +1263,12 @@ private:
     }
     bool HaveChannel(Channel *channel)
     {
-        auto iter = _channels.find(channel->Fd());
-        return iter != _channels.end();
+        int fd = channel->Fd();
+        return fd < (int)_channels.size() && _channels[fd] != nullptr;
     }
 
 public:
-    Poller() : _epfd(-1)
+    EpollPoller() : _epfd(-1)
     {
         _epfd = epoll_create(MAX_EPOLLEVENTS);
         if (_epfd < -1)
@@ -651,29 +1277,32 @@ public:
             exit(-1);
         }
     }
+    ~EpollPoller() { close(_epfd); }
+    PollerType Type() { return POLLER_EPOLL; }
     void UpdateEvent(Channel *channel) // 添加/修改监控事件
     {
         bool ret = HaveChannel(channel);
         if (ret == false)
         {
-            _channels.insert(std::make_pair(channel->Fd(), channel));
+            int fd = channel->Fd();
+            if (fd >= (int)_channels.size())
+                _channels.resize(std::max<size_t>(fd + 1, _channels.size() * 2), nullptr);
+            _channels[fd] = channel;
             return Update(channel, EPOLL_CTL_ADD); // 不存在添加
         }
         return Update(channel, EPOLL_CTL_MOD); // 存在就更新
     }
     void RemoveEvent(Channel *channel) // 移除监控事件
     {
-        auto iter = _channels.find(channel->Fd());
-        if (iter != _channels.end())
+        if (HaveChannel(channel))
         {
-            _channels.erase(iter);
+            _channels[channel->Fd()] = nullptr;
         }
         Update(channel, EPOLL_CTL_DEL);
     }
-    // 开始监控，返回活跃连接
-    void Poll(std::vector<Channel *> *actions)
+    // 开始监控，返回活跃连接（追加到actions中，调用者负责清空，这样数组的容量可以复用）
+    void Poll(std::vector<Channel *> *actions, int timeout)
     {
-        int timeout = -1;
         int nfds = epoll_wait(_epfd, _evs, MAX_EPOLLEVENTS, timeout);
         if (nfds < 0)
         {
@@ -684,77 +1313,568 @@ public:
         }
         for (int i = 0; i < nfds; ++i)
         {
-            auto iter = _channels.find(_evs[i].data.fd);
-            assert(iter != _channels.end());
-            iter->second->SetRevents(_evs[i].events);
-            actions->push_back(iter->second);
+            Channel *channel = static_cast<Channel *>(_evs[i].data.ptr);
+            assert(HaveChannel(channel) && _channels[channel->Fd()] == channel);
+            channel->SetRevents(_evs[i].events);
+            actions->push_back(channel);
         }
     }
 };
 
+#ifdef HAVE_IO_URING
 /**
- * 时间轮的设计思想：封装一个类，在定时任务创建的时候创建这个对象
- * 在定时任务将要被执行的时候，让这个对象被释放
- * 将定时任务需要执行的函数放在这个类的析构函数中调用，当对象被释放的时候会自动调用任务
- *
- * 手动管理比较麻烦，所以创建一个时间轮，存放某一时刻需要执行的定时任务
- * 当走到这个时刻的时候，执行这个时刻要执行的所有任务（释放这个时刻的所有对象）
- *
- * 由于存在延时、取消定时任务的需求，所以需要经常操作这个时间轮，比较麻烦，这里采用了智能指针管理
- * 使用shared_ptr管理对象指针，当引用计数为0时自动销毁
- *
- * 延时定时任务的时候就在时间轮上对应位置再加上一个该对象的shared_ptr，就能够实现延时的目的
- * 取消任务的时候
+ * UringPoller模块：用io_uring实现的事件监控，直接使用系统调用，不依赖liburing
+ * 实现思路：
+ *  每个Channel对应一个IORING_OP_POLL_ADD请求，水平触发的Channel使用单次触发的poll，触发之后在下一次Poll时重新提交，
+ *  重新提交的时候内核会重新检查就绪状态，所以和epoll的水平触发语义一致；边缘触发的Channel使用多次触发的poll，只提交一次
+ *  添加/修改/移除监控只是往提交队列中放入请求，等到Poll的时候和等待事件在同一次io_uring_enter中提交，不需要单独的系统调用
+ *  请求的user_data是 描述符|代数<<32，描述符每次重新注册或者修改事件代数都会加一，过期请求的完成事件直接丢弃，
+ *  这样Channel被移除释放之后，即使还有这个Channel的完成事件没有取出，也不会访问到已经释放的Channel
+ * 完成式的读（内核6.0以上）：
+ *  监听套接字提交一个多次触发的accept，每个新连接一个完成事件，不需要先等可读再调用accept
+ *  连接套接字提交一个多次触发的recv，数据由内核直接收到提供缓冲区的环中（每个loop一个环），每段数据一个完成事件，
+ *  poll只用来监控可写；数据放入Channel之后，缓冲区在下一次Poll时还给环，这时读回调已经把数据拷贝走了
+ *  关闭读监控时取消请求，取消生效之前已经收到的数据照常交给Channel；请求结束（不带IORING_CQE_F_MORE的完成事件）之后才会重新提交，
+ *  同一个Channel同时只有一个recv请求，数据的顺序不会乱；环中的缓冲区用完时请求以ENOBUFS结束，数据留在套接字中，还回缓冲区之后重新提交
+ *  accept/recv请求的代数和poll分开计数，修改poll监控的事件不会丢弃已经收到的数据；Channel移除之后收到的新连接直接关闭
  */
-using TaskFunc = std::function<void()>;
-using ReleaseFunc = std::function<void()>;
-class TimerTask
+class UringPoller : public Poller
 {
 private:
-    uint64_t _id;         // 定时器任务对象id
-    uint32_t _timeout;    // 定时任务超时时间
-    bool _canceled;       // false表示没有被取消，true表示被取消了
-    TaskFunc _task_cb;    // 定时器对象要执行的任务
-    ReleaseFunc _release; // 用于删除TimeWheel中保存的定时器对象信息
-
-public:
-    TimerTask(uint64_t id, uint32_t delay, const TaskFunc &cb)
-        : _id(id), _timeout(delay), _task_cb(cb), _canceled(false) {}
-    ~TimerTask()
+    struct Entry
     {
-        // LOG(DEBUG, "析构当前任务对象");
-        if (_canceled == false)
-            _task_cb();
-        _release();
-    }
-    void SetRelease(const ReleaseFunc &cb) { _release = cb; }
-    uint32_t DelayTime() { return _timeout; }
-    void Cancel() { _canceled = true; }
-};
-class TimerWheel
-{
-    using WeakTask = std::weak_ptr<TimerTask>;
-    using PtrTask = std::shared_ptr<TimerTask>;
+        Channel *_channel;       // 注册的Channel，nullptr表示没有注册
+        uint32_t _gen;           // poll请求的代数
+        uint32_t _op_gen;        // accept/recv请求的代数，只在重新注册的时候加一
+        uint32_t _armed_events;  // 已经提交的poll请求监控的事件
+        bool _armed;             // 当前是否有poll请求在内核中
+        bool _op_armed;          // 当前是否有accept/recv请求在内核中（收到最后一个完成事件之前一直算）
+        bool _op_canceling;      // 已经提交了取消accept/recv请求
+        bool _pending;           // 是否在等待提交的列表中
+        uint64_t _round;         // 最后一次放入就绪数组的轮次，同一轮的多个完成事件合并到一次回调中
+    };
+    const static uint64_t RemoveTag = 1ULL << 63; // 移除请求的user_data，完成事件直接丢弃
+    const static uint64_t AcceptTag = 1ULL << 30; // accept请求的user_data标记
+    const static uint64_t RecvTag = 1ULL << 31;   // recv请求的user_data标记
+    const static uint32_t EventMask = EPOLLIN | EPOLLOUT | EPOLLPRI | EPOLLRDHUP;
+    const static unsigned RecvBuffers = 256;     // 环中缓冲区的个数（2的幂）
+    const static unsigned RecvBufferSize = 4096; // 每个缓冲区的大小
+    const static uint16_t BufferGroup = 0;
+
+    int _ring_fd;
+    unsigned _sq_entries;
+    unsigned *_sq_head, *_sq_tail, *_sq_mask, *_sq_array;
+    struct io_uring_sqe *_sqes;
+    unsigned *_cq_head, *_cq_tail, *_cq_mask;
+    struct io_uring_cqe *_cqes;
+    void *_sq_ring, *_cq_ring;
+    size_t _sq_ring_size, _cq_ring_size, _sqes_size;
+    unsigned _to_submit;          // 已经放入提交队列还没有提交的请求个数
+    std::vector<Entry> _entries;  // 按描述符下标记录注册的Channel
+    std::vector<int> _pending;    // 等待提交poll请求的描述符
+    uint64_t _round;              // Poll的轮次
+#ifdef HAVE_IO_URING_MULTISHOT
+    bool _multishot;                   // 内核支持多次触发的accept/recv，提供缓冲区的环已经注册
+    struct io_uring_buf_ring *_buf_ring; // 提供缓冲区的环
+    char *_bufs;                       // 环中的缓冲区，bid对应第bid个
+    uint16_t _buf_tail;                // 环的tail，只有这个线程修改
+    std::vector<uint16_t> _consumed;   // 这一轮交给Channel的缓冲区，下一次Poll时还给环
+#endif
 
 private:
-    int _tick;                                      // 当前的秒针，走到哪里就释放哪里
-    int _capacity;                                  // 表盘的最大数量（最大延迟时间）
-    std::vector<std::vector<PtrTask>> _wheel;       // 时间轮
-    std::unordered_map<uint64_t, WeakTask> _timers; // 保存定时任务
-    EventLoop *_loop;                               // 事件管理模块的指针
-    int _timerfd;                                   // 定时器描述符
-    std::unique_ptr<Channel> _timer_channel;        // 定时器的channel
-public:
-    TimerWheel(EventLoop *loop)
-        : _capacity(60), _tick(0), _wheel(_capacity), _loop(loop), _timerfd(CreateTimerfd()),
-          _timer_channel(new Channel(_timerfd, loop))
+    static uint64_t UserData(int fd, uint32_t gen) { return ((uint64_t)gen << 32) | (uint32_t)fd; }
+    static uint64_t OpData(Channel *channel, uint32_t gen)
     {
-        _timer_channel->SetReadCallback(std::bind(&TimerWheel::OnTime, this));
-        _timer_channel->EnableRead();
+        return UserData(channel->Fd(), gen) | (channel->GetCompletion() == COMPLETION_ACCEPT ? AcceptTag : RecvTag);
     }
-    ~TimerWheel() {}
-    // 这里对于_timers和_wheel的操作要考虑线程安全问题，如果不想给每次操作都加锁的话，那就让这个函数只能够被EventLoop线程调用
-    void TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb);
+    // poll请求监控的事件：完成式读的Channel由accept/recv请求读，poll只监控剩下的事件
+    static uint32_t PollEvents(Channel *channel)
+    {
+        uint32_t events = channel->Events() & (EventMask | EPOLLET);
+        if (channel->GetCompletion() != COMPLETION_NONE)
+            events &= ~(EPOLLIN | EPOLLPRI | EPOLLRDHUP);
+        return events;
+    }
+    static bool WantOp(Channel *channel) { return channel->GetCompletion() != COMPLETION_NONE && (channel->Events() & EPOLLIN); }
+    int Enter(unsigned min_complete)
+    {
+        int ret = syscall(__NR_io_uring_enter, _ring_fd, _to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (ret > 0)
+            _to_submit -= ret;
+        return ret;
+    }
+    struct io_uring_sqe *GetSqe()
+    {
+        unsigned tail = *_sq_tail;
+        if (tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries)
+            Enter(0); // 提交队列满了，先提交一次
+        unsigned idx = tail & *_sq_mask;
+        struct io_uring_sqe *sqe = &_sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        _sq_array[idx] = idx;
+        __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++_to_submit;
+        return sqe;
+    }
+    void PrepPoll(int fd, uint32_t events, uint64_t user_data)
+    {
+        struct io_uring_sqe *sqe = GetSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        sqe->len = (events & EPOLLET) ? IORING_POLL_ADD_MULTI : 0;
+        sqe->user_data = user_data;
+    }
+    void PrepRemove(uint64_t target)
+    {
+        struct io_uring_sqe *sqe = GetSqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = RemoveTag;
+    }
+#ifdef HAVE_IO_URING_MULTISHOT
+    void PrepOp(Channel *channel, uint64_t user_data)
+    {
+        struct io_uring_sqe *sqe = GetSqe();
+        sqe->fd = channel->Fd();
+        sqe->user_data = user_data;
+        if (channel->GetCompletion() == COMPLETION_ACCEPT)
+        {
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT; // 不需要对端地址，addr为空
+            return;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT; // 长度为0，每次用环中的一个缓冲区
+        sqe->buf_group = BufferGroup;
+    }
+    void PrepCancel(uint64_t target)
+    {
+        struct io_uring_sqe *sqe = GetSqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = RemoveTag;
+    }
+    void ProvideBuffer(uint16_t bid) // 放入环中，RecycleBuffers里统一发布
+    {
+        // 头文件中的bufs在C++里不在偏移0处（__DECLARE_FLEX_ARRAY前面有一个空结构体），直接从环的起始地址计算
+        struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf *>(_buf_ring) + (_buf_tail & (RecvBuffers - 1));
+        buf->addr = (uint64_t)(_bufs + (size_t)bid * RecvBufferSize);
+        buf->len = RecvBufferSize;
+        buf->bid = bid;
+        ++_buf_tail;
+    }
+    void RecycleBuffers() // 上一轮交给Channel的缓冲区还给环
+    {
+        if (_consumed.empty())
+            return;
+        for (uint16_t bid : _consumed)
+            ProvideBuffer(bid);
+        _consumed.clear();
+        __atomic_store_n(&_buf_ring->tail, _buf_tail, __ATOMIC_RELEASE);
+    }
+    // 注册提供缓冲区的环，内核不支持的时候返回false，只使用poll
+    bool InitBufferRing()
+    {
+        // 多次触发的recv和IORING_OP_SEND_ZC都是6.0加入的，用它判断内核版本
+        size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+        std::unique_ptr<char[]> probe_buf(new char[probe_size]());
+        struct io_uring_probe *probe = reinterpret_cast<struct io_uring_probe *>(probe_buf.get());
+        if (syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+            return false;
+        if (probe->last_op < IORING_OP_SEND_ZC || (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED) == 0)
+            return false;
+        void *ring = mmap(nullptr, RecvBuffers * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED)
+            return false;
+        _buf_ring = static_cast<struct io_uring_buf_ring *>(ring);
+        void *bufs = mmap(nullptr, (size_t)RecvBuffers * RecvBufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (bufs == MAP_FAILED)
+            return false;
+        _bufs = static_cast<char *>(bufs);
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)_buf_ring;
+        reg.ring_entries = RecvBuffers;
+        reg.bgid = BufferGroup;
+        if (syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+            return false;
+        for (unsigned i = 0; i < RecvBuffers; ++i)
+            ProvideBuffer(i);
+        __atomic_store_n(&_buf_ring->tail, _buf_tail, __ATOMIC_RELEASE);
+        return true;
+    }
+    // accept/recv请求的完成事件
+    void Complete(struct io_uring_cqe *cqe, std::vector<Channel *> *actions)
+    {
+        int fd = (int)(cqe->user_data & (AcceptTag - 1));
+        uint32_t gen = (uint32_t)(cqe->user_data >> 32);
+        const char *data = nullptr;
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+        {
+            uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            _consumed.push_back(bid);
+            data = _bufs + (size_t)bid * RecvBufferSize;
+        }
+        Entry *e = fd < (int)_entries.size() ? &_entries[fd] : nullptr;
+        if (e == nullptr || e->_channel == nullptr || e->_op_gen != gen)
+        {
+            // Channel已经移除，接收到的新连接没有人处理，直接关闭；连接上的数据直接丢弃（连接已经关闭）
+            if ((cqe->user_data & AcceptTag) && cqe->res >= 0)
+                close(cqe->res);
+            return;
+        }
+        if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+        {
+            // 请求已经结束，需要的话下一次Poll时重新提交
+            e->_op_armed = false;
+            e->_op_canceling = false;
+            Pend(fd);
+        }
+        if (cqe->res == -ECANCELED || cqe->res == -ENOBUFS)
+            return; // 取消或者缓冲区用完了，不是连接出错
+        e->_channel->AddCompletion(cqe->res, data);
+        Push(*e, EPOLLIN, actions);
+    }
+#endif
+    void Push(Entry &e, uint32_t events, std::vector<Channel *> *actions)
+    {
+        if (e._round == _round)
+            return e._channel->SetRevents(e._channel->Revents() | events);
+        e._round = _round;
+        e._channel->SetRevents(events);
+        actions->push_back(e._channel);
+    }
+    void Pend(int fd)
+    {
+        Entry &e = _entries[fd];
+        if (e._pending == false)
+        {
+            e._pending = true;
+            _pending.push_back(fd);
+        }
+    }
+    Entry *Find(Channel *channel)
+    {
+        int fd = channel->Fd();
+        if (fd >= (int)_entries.size())
+            _entries.resize(std::max<size_t>(fd + 1, _entries.size() * 2), Entry{nullptr, 0, 0, 0, false, false, false, false, 0});
+        return &_entries[fd];
+    }
+
+public:
+    UringPoller()
+        : _ring_fd(-1), _sq_entries(0), _sq_head(nullptr), _sq_tail(nullptr), _sq_mask(nullptr), _sq_array(nullptr), _sqes(nullptr),
+          _cq_head(nullptr), _cq_tail(nullptr), _cq_mask(nullptr), _cqes(nullptr), _sq_ring(MAP_FAILED), _cq_ring(MAP_FAILED),
+          _sq_ring_size(0), _cq_ring_size(0), _sqes_size(0), _to_submit(0), _round(0)
+#ifdef HAVE_IO_URING_MULTISHOT
+          , _multishot(false), _buf_ring(nullptr), _bufs(nullptr), _buf_tail(0)
+#endif
+    {
+    }
+    ~UringPoller()
+    {
+        if (_sqes != nullptr)
+            munmap(_sqes, _sqes_size);
+        if (_cq_ring != MAP_FAILED && _cq_ring != _sq_ring)
+            munmap(_cq_ring, _cq_ring_size);
+        if (_sq_ring != MAP_FAILED)
+            munmap(_sq_ring, _sq_ring_size);
+        if (_ring_fd >= 0)
+            close(_ring_fd);
+#ifdef HAVE_IO_URING_MULTISHOT
+        // 环注册的时候内核固定了这些页，关闭io_uring之后再释放
+        if (_bufs != nullptr)
+            munmap(_bufs, (size_t)RecvBuffers * RecvBufferSize);
+        if (_buf_ring != nullptr)
+            munmap(_buf_ring, RecvBuffers * sizeof(struct io_uring_buf));
+#endif
+    }
+    // 创建io_uring实例，内核不支持（或者被禁止使用）的时候返回false
+    bool Init()
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        _ring_fd = syscall(__NR_io_uring_setup, MAX_EPOLLEVENTS, &params);
+        if (_ring_fd < 0)
+            return false;
+        // 多次触发的poll是5.13加入的，同一个版本加入了IORING_FEAT_RSRC_TAGS，用它判断内核版本
+        if ((params.features & IORING_FEAT_RSRC_TAGS) == 0)
+            return false;
+        _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+        _sq_ring = mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+        if (_sq_ring == MAP_FAILED)
+            return false;
+        _cq_ring = _sq_ring;
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0)
+        {
+            _cq_ring = mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+            if (_cq_ring == MAP_FAILED)
+                return false;
+        }
+        _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        void *sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        _sqes = static_cast<struct io_uring_sqe *>(sqes);
+        char *sq = static_cast<char *>(_sq_ring);
+        char *cq = static_cast<char *>(_cq_ring);
+        _sq_entries = params.sq_entries;
+        _sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        _sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        _sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        _sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        _cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        _cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        _cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+#ifdef HAVE_IO_URING_MULTISHOT
+        _multishot = InitBufferRing(); // 不支持的时候所有Channel都用poll
+#endif
+        return true;
+    }
+    PollerType Type() { return POLLER_IO_URING; }
+#ifdef HAVE_IO_URING_MULTISHOT
+    bool SupportCompletion(CompletionMode mode) { return _multishot && mode != COMPLETION_NONE; }
+#endif
+    void UpdateEvent(Channel *channel) // 添加/修改监控事件
+    {
+        Entry *e = Find(channel);
+        if (e->_channel == nullptr)
+        {
+            e->_channel = channel;
+            ++e->_gen;
+            ++e->_op_gen;
+            e->_armed = false;
+            e->_op_armed = false;
+            e->_op_canceling = false;
+        }
+        else
+        {
+            // 监控的事件没有变化就不需要重新提交
+            if (e->_armed && PollEvents(channel) != e->_armed_events)
+            {
+                PrepRemove(UserData(channel->Fd(), e->_gen));
+                ++e->_gen;
+                e->_armed = false;
+            }
+#ifdef HAVE_IO_URING_MULTISHOT
+            // 关闭读监控：取消accept/recv请求，取消生效之前收到的结果照常处理
+            if (e->_op_armed && e->_op_canceling == false && WantOp(channel) == false)
+            {
+                PrepCancel(OpData(channel, e->_op_gen));
+                e->_op_canceling = true;
+            }
+#endif
+        }
+        Pend(channel->Fd());
+    }
+    void RemoveEvent(Channel *channel) // 移除监控事件
+    {
+        Entry *e = Find(channel);
+        if (e->_channel == nullptr)
+            return;
+        if (e->_armed)
+            PrepRemove(UserData(channel->Fd(), e->_gen));
+#ifdef HAVE_IO_URING_MULTISHOT
+        if (e->_op_armed && e->_op_canceling == false)
+        {
+            PrepCancel(OpData(channel, e->_op_gen));
+            // 请求持有套接字的引用，监听套接字马上提交取消，否则关闭之后端口还被占用，直到下一次Poll
+            if (channel->GetCompletion() == COMPLETION_ACCEPT)
+                Enter(0);
+        }
+#endif
+        ++e->_gen;
+        ++e->_op_gen;
+        e->_channel = nullptr;
+        e->_armed = false;
+        e->_op_armed = false;
+        e->_op_canceling = false;
+    }
+    // 这里timeout只区分是否阻塞：0的时候只提交请求，-1的时候等待至少一个完成事件
+    void Poll(std::vector<Channel *> *actions, int timeout)
+    {
+        ++_round;
+#ifdef HAVE_IO_URING_MULTISHOT
+        RecycleBuffers(); // 上一轮的数据已经被读回调拷贝走了
+#endif
+        // 1. 提交需要（重新）监控的poll请求和accept/recv请求
+        for (int fd : _pending)
+        {
+            Entry &e = _entries[fd];
+            e._pending = false;
+            if (e._channel == nullptr)
+                continue;
+#ifdef HAVE_IO_URING_MULTISHOT
+            if (e._op_armed == false && WantOp(e._channel))
+            {
+                PrepOp(e._channel, OpData(e._channel, e._op_gen));
+                e._op_armed = true;
+            }
+#endif
+            if (e._armed)
+                continue;
+            uint32_t events = PollEvents(e._channel);
+            if ((events & EventMask) == 0)
+                continue;
+            PrepPoll(fd, events, UserData(fd, e._gen));
+            e._armed = true;
+            e._armed_events = events;
+        }
+        _pending.clear();
+        // 2. 提交请求并等待完成事件，已经有完成事件的时候不阻塞
+        bool ready = *_cq_head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        int ret = Enter((ready || timeout == 0) ? 0 : 1);
+        if (ret < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+        {
+            LOG(ERROR, "io_uring_enter error, code: %d, reason: %s", errno, strerror(errno));
+            exit(-2);
+        }
+        // 3. 取出完成事件
+        unsigned head = *_cq_head;
+        unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            struct io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+            if (cqe->user_data & RemoveTag)
+                continue;
+#ifdef HAVE_IO_URING_MULTISHOT
+            if (cqe->user_data & (AcceptTag | RecvTag))
+            {
+                Complete(cqe, actions);
+                continue;
+            }
+#endif
+            int fd = (int)(uint32_t)cqe->user_data;
+            uint32_t gen = (uint32_t)(cqe->user_data >> 32);
+            if (fd >= (int)_entries.size())
+                continue;
+            Entry &e = _entries[fd];
+            if (e._channel == nullptr || e._gen != gen)
+                continue; // 过期的请求
+            if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+            {
+                // 请求已经结束，下一次Poll时重新提交
+                e._armed = false;
+                Pend(fd);
+            }
+            if (cqe->res < 0)
+                continue;
+            Push(e, cqe->res, actions);
+        }
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    }
+};
+#endif
+
+// 创建指定类型的Poller，io_uring不可用的时候退回到epoll
+inline Poller *Poller::Create(PollerType type)
+{
+#ifdef HAVE_IO_URING
+    if (type == POLLER_IO_URING)
+    {
+        UringPoller *poller = new UringPoller();
+        if (poller->Init())
+            return poller;
+        delete poller;
+        LOG(ERROR, "io_uring is not available, code: %d, reason: %s, fall back to epoll", errno, strerror(errno));
+    }
+#endif
+    return new EpollPoller();
+}
+
+/**
+ * 时间轮的设计思想：每个定时任务是一个侵入式的链表节点，挂在时间轮中到期时间对应的槽上
+ * 当走到这个时刻的时候，执行这个时刻的槽上的所有任务
+ *
+ * 节点中保存了所在的层和槽，以及指向前一个节点的指针，所以添加、取消、刷新（从原来的槽上摘下来挂到新的槽上）都是O(1)的
+ * 定时任务有两种用法：
+ *  1. 使用者自己持有TimerTask（比如嵌入在连接对象中），通过指针直接操作，不需要申请内存也不需要查表
+ *  2. 通过id添加，节点从时间轮的节点池中取出，执行或者取消之后放回池中，用id查找节点
+ */
+using TaskFunc = std::function<void()>;
+class TimerTask
+{
+    friend class TimerWheel;
+
+private:
+    TimerTask *_next;   // 所在槽的链表中的下一个节点
+    TimerTask **_pprev; // 指向前一个节点的_next（或者槽的头指针），不在时间轮中时为nullptr
+    uint64_t _expire;   // 到期时间（毫秒）
+    uint32_t _timeout;  // 定时任务超时时间（毫秒）
+    uint8_t _level;     // 所在的层
+    uint8_t _slot;      // 所在的槽
+    bool _pooled;       // 是否是从节点池中取出的节点（通过id添加的定时任务）
+    uint64_t _id;       // 通过id添加时的定时器id
+    TaskFunc _task_cb;  // 定时器对象要执行的任务
+
+public:
+    TimerTask() : _next(nullptr), _pprev(nullptr), _expire(0), _timeout(0), _level(0), _slot(0), _pooled(false), _id(0) {}
+    TimerTask(const TimerTask &) = delete;
+    TimerTask &operator=(const TimerTask &) = delete;
+    // 到期时调用的任务，任务中不能销毁这个节点，但是可以重新启动它
+    void SetCallback(const TaskFunc &cb) { _task_cb = cb; }
+    uint32_t DelayTime() { return _timeout; }
+    bool Linked() { return _pprev != nullptr; } // 是否在时间轮中等待到期
+};
+/**
+ * 分层时间轮：最底层256个1毫秒的槽，上面4层各64个槽，每层一个槽对应下一层转一圈的时间
+ *  第0层256毫秒，第1层约16秒，第2层约17分钟，第3层约18小时，第4层覆盖uint32毫秒的全部范围（约49天）
+ * 时间走到上层槽的起点时，把这个槽里的节点按到期时间重新挂到下面的层（级联），走到第0层的槽时执行槽里的任务
+ * 每层用位图记录非空的槽，可以直接算出下一个需要处理的时间点，timerfd只在这个时间点触发，没有定时任务的时候不触发
+ */
+class TimerWheel
+{
+    const static int Levels = 5;
+    const static int Level0Bits = 8;  // 第0层256个槽
+    const static int LevelBits = 6;   // 上面每层64个槽
+    const static int PoolChunk = 256; // 节点池每次扩充的节点个数
+    const static uint64_t NoTick = UINT64_MAX;
+
+public:
+    const static uint32_t MaxDelay = UINT32_MAX; // 最大的延迟（毫秒），约49.7天，第4层正好覆盖
+    // 秒转换为毫秒，超过MaxDelay的按MaxDelay计算，不会回绕成很短的延迟
+    static uint32_t SecondsToMs(uint64_t sec) { return sec > MaxDelay / 1000 ? MaxDelay : sec * 1000; }
+
+private:
+    uint64_t (*_clock)();                            // 时间来源（毫秒），默认是CLOCK_MONOTONIC
+    uint64_t _current;                               // 时间轮当前走到的时间（毫秒），走到哪里就执行哪里
+    uint64_t _armed;                                 // timerfd设置的触发时间，NoTick表示没有设置
+    size_t _count;                                   // 时间轮中的节点个数
+    TimerTask *_wheel[Levels][1 << Level0Bits];      // 时间轮，每个槽是一个链表，上面几层只用前64个槽
+    uint64_t _bitmap[Levels][4];                     // 非空的槽
+    std::vector<std::unique_ptr<TimerTask[]>> _pool; // 通过id添加的定时任务使用的节点
+    TimerTask *_free_nodes;                          // 节点池中空闲的节点
+    std::unordered_map<uint64_t, TimerTask *> _timers; // 通过id添加的定时任务
+    EventLoop *_loop;                                // 事件管理模块的指针
+    int _timerfd;                                    // 定时器描述符
+    std::unique_ptr<Channel> _timer_channel;         // 定时器的channel
+public:
+    TimerWheel(EventLoop *loop)
+        : _clock(NowMs), _current(NowMs()), _armed(NoTick), _count(0), _free_nodes(nullptr), _loop(loop), _timerfd(CreateTimerfd()),
+          _timer_channel(new Channel(_timerfd, loop))
+    {
+        memset(_wheel, 0, sizeof(_wheel));
+        memset(_bitmap, 0, sizeof(_bitmap));
+        _timer_channel->SetReadCallback(std::bind(&TimerWheel::OnTime, this));
+        _timer_channel->EnableRead();
+    }
+    ~TimerWheel() { close(_timerfd); }
+    // 替换时间来源，测试中用来模拟时间的流逝（timerfd仍然按这个时间设置，需要自己调用RunTimerTask）；只能在没有定时任务的时候调用
+    void SetClock(uint64_t (*clock)())
+    {
+        _clock = clock;
+        _current = clock();
+    }
+    // 这里对于_timers和_wheel的操作要考虑线程安全问题，如果不想给每次操作都加锁的话，那就让这个函数只能够被EventLoop线程调用
+    void TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb); // delay的单位是毫秒
     void TimerRefresh(uint64_t id);
     void TimerCancel(uint64_t id);
     // 这个接口存在线程安全问题，所以只能够在EventLoop线程内调用
@@ -767,32 +1887,214 @@ public:
         }
         return true;
     }
+    /* 使用者自己持有节点的接口，只能在EventLoop线程内调用 */
+    void TimerStart(TimerTask *timer, uint32_t delay) // 启动定时任务，已经启动的重新计时，delay的单位是毫秒
+    {
+        Schedule(timer, delay);
+    }
+    void TimerRestart(TimerTask *timer) // 按原来的超时时间重新计时
+    {
+        Schedule(timer, timer->_timeout);
+    }
+    void TimerStop(TimerTask *timer)
+    {
+        if (timer->Linked())
+        {
+            Unlink(timer);
+            Arm();
+        }
+    }
 
-    void RunTimerTask() // 这个函数相当于每秒钟执行一次，相当于秒针向后走
+    void RunTimerTask() // 时间轮走到当前时间，处理这期间所有到期的槽
     {
-        _tick = (_tick + 1) % _capacity;
-        _wheel[_tick].clear(); // 清空当前位置的数组就会自动销毁对应的对象，此时如果有引用计数为0的对象，将会自动调用析构函数，执行定时任务
-        // LOG(DEBUG, "执行了当前时间对应的定时任务");
+        uint64_t now = _clock();
+        uint64_t tick;
+        while ((tick = NextTick()) <= now)
+        {
+            _current = tick;
+            // 先从上往下级联，上层的节点可能正好落到这一刻第0层的槽中
+            for (int level = Levels - 1; level > 0; --level)
+            {
+                int shift = Shift(level);
+                if ((tick & ((1ULL << shift) - 1)) == 0)
+                    Cascade(level, (tick >> shift) & ((1 << LevelBits) - 1));
+            }
+            // 每次从槽的头部取一个执行，任务中取消或者刷新同一个槽中的其他节点也不会出问题
+            // 任务中新添加的节点到期时间一定在当前时间之后，不会挂到这个槽上
+            TimerTask *timer;
+            int idx = tick & ((1 << Level0Bits) - 1);
+            while ((timer = _wheel[0][idx]) != nullptr)
+                Fire(timer);
+        }
+        if (now > _current)
+            _current = now; // 中间没有需要处理的槽，直接走到当前时间
+        Arm();
     }
 
 private:
+    static uint64_t NowMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+    static int Shift(int level) { return level == 0 ? 0 : Level0Bits + (level - 1) * LevelBits; }
+    static int Slots(int level) { return level == 0 ? (1 << Level0Bits) : (1 << LevelBits); }
+    bool TestBit(int level, int idx) { return (_bitmap[level][idx >> 6] >> (idx & 63)) & 1; }
+    void SetBit(int level, int idx) { _bitmap[level][idx >> 6] |= 1ULL << (idx & 63); }
+    void ClearBit(int level, int idx) { _bitmap[level][idx >> 6] &= ~(1ULL << (idx & 63)); }
+    // 从start开始（包括start）循环查找第一个非空的槽，返回和start的距离，没有返回-1
+    int FindSlot(int level, int start)
+    {
+        int slots = Slots(level);
+        for (int i = 0; i < slots;)
+        {
+            int idx = (start + i) & (slots - 1);
+            uint64_t word = _bitmap[level][idx >> 6] >> (idx & 63);
+            if (word)
+                return i + __builtin_ctzll(word);
+            i += 64 - (idx & 63);
+        }
+        return -1;
+    }
+    // 下一个需要处理的时间点：第0层下一个非空槽的时间，或者上层下一个非空槽的级联时间
+    uint64_t NextTick()
+    {
+        if (_count == 0)
+            return NoTick;
+        uint64_t next = NoTick;
+        int d = FindSlot(0, (_current + 1) & ((1 << Level0Bits) - 1));
+        if (d >= 0)
+            next = _current + 1 + d;
+        for (int level = 1; level < Levels; ++level)
+        {
+            int shift = Shift(level);
+            uint64_t round = (_current >> shift) + 1; // 下一个级联的时间是round << shift
+            d = FindSlot(level, round & ((1 << LevelBits) - 1));
+            if (d >= 0)
+                next = std::min(next, (round + d) << shift);
+        }
+        return next;
+    }
+    void Link(TimerTask *timer) // 按到期时间挂到对应的槽上
+    {
+        uint64_t delta = timer->_expire > _current ? timer->_expire - _current : 0;
+        int level = 0;
+        while (level < Levels - 1 && delta >= (1ULL << Shift(level + 1)))
+            ++level;
+        int idx = (timer->_expire >> Shift(level)) & (Slots(level) - 1);
+        TimerTask *&head = _wheel[level][idx];
+        timer->_next = head;
+        if (head != nullptr)
+            head->_pprev = &timer->_next;
+        head = timer;
+        timer->_pprev = &head;
+        timer->_level = level;
+        timer->_slot = idx;
+        SetBit(level, idx);
+        ++_count;
+    }
+    void Unlink(TimerTask *timer) // 从所在的槽上摘下来
+    {
+        *timer->_pprev = timer->_next;
+        if (timer->_next != nullptr)
+            timer->_next->_pprev = timer->_pprev;
+        if (_wheel[timer->_level][timer->_slot] == nullptr)
+            ClearBit(timer->_level, timer->_slot);
+        timer->_next = nullptr;
+        timer->_pprev = nullptr;
+        --_count;
+    }
+    void Cascade(int level, int idx)
+    {
+        TimerTask *timer;
+        while ((timer = _wheel[level][idx]) != nullptr)
+        {
+            Unlink(timer);
+            Link(timer); // 到期时间离现在不到这一层一个槽的时间，一定会挂到下面的层
+        }
+    }
+    void Fire(TimerTask *timer)
+    {
+        Unlink(timer);
+        if (timer->_pooled == false)
+            return timer->_task_cb();
+        // 通过id添加的任务：先放回节点池再执行，任务中可以再用同一个id添加
+        TaskFunc cb;
+        cb.swap(timer->_task_cb);
+        ReleaseNode(timer);
+        cb();
+    }
+    // 挂到新的到期时间，到期时间从现在开始计算
+    void Schedule(TimerTask *timer, uint32_t delay)
+    {
+        if (timer->Linked())
+            Unlink(timer);
+        if (_count == 0)
+            _current = std::max(_current, _clock() - 1); // 空闲的时候时间轮没有走，先追上当前时间
+        timer->_timeout = delay;
+        timer->_expire = std::max(_clock() + delay, _current + 1);
+        Link(timer);
+        Arm();
+    }
+    // 把timerfd设置到下一个需要处理的时间点（绝对时间），已经设置好的不再重复设置
+    void Arm()
+    {
+        uint64_t next = NextTick();
+        if (next == _armed)
+            return;
+        _armed = next;
+        struct itimerspec itime;
+        memset(&itime, 0, sizeof(itime)); // 全为0表示停止定时器
+        if (next != NoTick)
+        {
+            itime.it_value.tv_sec = next / 1000;
+            itime.it_value.tv_nsec = (next % 1000) * 1000000;
+        }
+        timerfd_settime(_timerfd, TFD_TIMER_ABSTIME, &itime, NULL);
+    }
+    TimerTask *AcquireNode() // 从节点池中取一个节点，不够的时候一次扩充一批
+    {
+        if (_free_nodes == nullptr)
+        {
+            TimerTask *chunk = new TimerTask[PoolChunk];
+            _pool.push_back(std::unique_ptr<TimerTask[]>(chunk));
+            for (int i = 0; i < PoolChunk; ++i)
+            {
+                chunk[i]._pooled = true;
+                chunk[i]._next = _free_nodes;
+                _free_nodes = &chunk[i];
+            }
+        }
+        TimerTask *timer = _free_nodes;
+        _free_nodes = timer->_next;
+        timer->_next = nullptr;
+        return timer;
+    }
+    void ReleaseNode(TimerTask *timer) // 放回节点池，同时删除id的记录
+    {
+        auto it = _timers.find(timer->_id);
+        if (it != _timers.end() && it->second == timer) // 同一个id可能已经添加了新的任务
+            _timers.erase(it);
+        timer->_task_cb = nullptr;
+        timer->_next = _free_nodes;
+        _free_nodes = timer;
+    }
     void TimerAddInLoop(uint64_t id, uint32_t delay, const TaskFunc &cb) // 添加定时任务
     {
-        PtrTask pt(new TimerTask(id, delay, cb));
-        pt->SetRelease(std::bind(&TimerWheel::RemoveTimer, this, id));
-        _wheel[(_tick + delay) % _capacity].push_back(pt);
-        _timers[id] = WeakTask(pt);
+        TimerTask *timer = AcquireNode();
+        timer->_id = id;
+        timer->_task_cb = cb;
+        _timers[id] = timer;
+        Schedule(timer, delay);
         // LOG(DEBUG, "添加定时任务成功");
     }
     void TimerRefreshInLoop(uint64_t id) // 刷新、延迟定时任务
     {
-        // 通过保存的定时器对象_timers找到对应的weak_ptr，构造shared_ptr，添加到时间轮
         auto it = _timers.find(id);
         if (it == _timers.end())
-            return;                     // 不存在定时任务，没办法刷新延迟
-        PtrTask pt = it->second.lock(); // 获取到weak_ptr对象对应的shared_ptr
-        int delay = pt->DelayTime();
-        _wheel[(_tick + delay) % _capacity].push_back(pt);
+            return; // 不存在定时任务，没办法刷新延迟
+        TimerRestart(it->second);
         // LOG(DEBUG, "刷新定时任务");
     }
     void TimerCancelInLoop(uint64_t id)
@@ -800,53 +2102,227 @@ private:
         auto it = _timers.find(id);
         if (it == _timers.end())
             return; // 不存在定时任务，没办法取消
-        PtrTask pt = it->second.lock();
-        if (pt)
-            pt->Cancel();
+        TimerTask *timer = it->second;
+        TimerStop(timer);
+        ReleaseNode(timer);
     }
     static int CreateTimerfd()
     {
-        int timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+        // 创建之后不设置超时时间，有定时任务的时候再设置到最近的到期时间
+        int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
         if (timerfd < 0)
         {
             LOG(ERROR, "timerfd create error, code:%d, reason: %s", errno, strerror(errno));
             abort();
         }
-        struct itimerspec itime;
-        itime.it_value.tv_sec = 1;
-        itime.it_value.tv_nsec = 0; // 第一次的超时时间为1s
-        itime.it_interval.tv_sec = 1;
-        itime.it_interval.tv_nsec = 0; // 第一次超时之后，每次超时的时间间隔
-        timerfd_settime(timerfd, 0, &itime, NULL);
         return timerfd;
     }
-    /* 有可能因为其他事件的处理花费事件很长，在处理定时器描述符事件的时候，有可能已经超时了很多次了， 这里read的返回值就是超时的次数*/
-    int ReadTimerFd()
+    /* 只是把timerfd的可读状态清除，实际到期的任务根据当前时间计算 */
+    void ReadTimerFd()
     {
         uint64_t times;
         int ret = read(_timerfd, &times, 8);
-        if (ret < 0)
+        if (ret < 0 && errno != EAGAIN && errno != EINTR)
         {
             LOG(ERROR, "read timerfd error");
             abort();
         }
-        return times;
     }
     void OnTime()
     {
         // LOG(DEBUG, "触发了定时任务事件");
-        int times = ReadTimerFd(); // 根据实际超时的次数执行超时任务
-        for (int i = 0; i < times; ++i)
+        ReadTimerFd();
+        _armed = NoTick; // 一次性的定时器，触发之后需要重新设置
+        RunTimerTask();
+    }
+};
+
+/**
+ * TaskQueue：多生产者单消费者的无锁任务队列（侵入式链表，每个节点保存一个任务）
+ * 生产者用一次原子交换把节点挂到队尾，不需要加锁；只有EventLoop线程取任务
+ * 实现思路：
+ *  _head是最后一个入队的节点，_tail是下一个要取出的节点，队列中始终至少有一个节点，空的时候是_stub
+ *  生产者交换_head之后、设置前一个节点的_next之前，消费者会认为队列暂时为空，这个任务留到下一次再取
+ * 任务的闭包直接移动构造在节点后面的存储空间中，不经过std::function，所以也支持只能移动的闭包
+ *  节点有两种大小，常见的闭包（成员函数指针+this+几个参数，或者一个std::function）放在小节点中，
+ *  比较大的（比如Upgrade带着一个Any和四个回调函数）放在大节点中，再大的才在堆上单独申请
+ *  执行完的节点由EventLoop线程放回队列的空闲链表，生产者线程把整个空闲链表一次取走放到自己线程的缓存中使用，
+ *  稳定之后入队不再申请内存
+ */
+class TaskQueue
+{
+public:
+    struct Node
+    {
+        std::atomic<Node *> _next;
+        void (*_invoke)(void *);  // 调用闭包
+        void (*_destroy)(void *); // 析构闭包
+        int _class;               // 节点大小的类别，-1表示占位节点
+        Node() : _next(nullptr), _invoke(nullptr), _destroy(nullptr), _class(-1) {}
+        void *Storage() { return reinterpret_cast<char *>(this) + HeaderSize; }
+    };
+    const static size_t HeaderSize = 32;     // 节点头部的大小，闭包从这里开始存放，16字节对齐
+    const static size_t SmallNodeSize = 128; // 小节点可以存放96字节的闭包
+    const static size_t LargeNodeSize = 256; // 大节点可以存放224字节的闭包
+    const static size_t MaxInlineSize = LargeNodeSize - HeaderSize;
+
+private:
+    // 每个线程缓存的空闲节点，线程退出的时候释放
+    struct NodeCache
+    {
+        Node *_free[2];
+        NodeCache() : _free{nullptr, nullptr} {}
+        ~NodeCache()
         {
-            RunTimerTask();
+            for (Node *node : _free)
+            {
+                while (node != nullptr)
+                {
+                    Node *next = node->_next.load(std::memory_order_relaxed);
+                    ::operator delete(node);
+                    node = next;
+                }
+            }
         }
+    };
+    static NodeCache &LocalCache()
+    {
+        static thread_local NodeCache cache;
+        return cache;
     }
-    /* 用这个函数的时候，一定是shared_ptr的引用已经=0，此时weak_ptr也不需要存在了 */
-    void RemoveTimer(uint64_t id) // 从_timers中删除定时任务
+
+    std::atomic<Node *> _head;    // 生产者入队的位置
+    Node *_tail;                  // 消费者出队的位置，只有消费者访问
+    Node _stub;                   // 占位节点
+    std::atomic<Node *> _free[2]; // 执行完的空闲节点，只有消费者放入，生产者一次全部取走
+
+private:
+    void PushNode(Node *node)
     {
-        auto it = _timers.find(id);
-        if (it != _timers.end())
-            _timers.erase(id);
+        node->_next.store(nullptr, std::memory_order_relaxed);
+        Node *prev = _head.exchange(node, std::memory_order_acq_rel);
+        prev->_next.store(node, std::memory_order_release);
+    }
+    Node *AllocNode(int cls)
+    {
+        NodeCache &cache = LocalCache();
+        Node *node = cache._free[cls];
+        if (node == nullptr)
+            node = _free[cls].exchange(nullptr, std::memory_order_acquire); // 本线程的缓存用完了，取走队列的空闲链表
+        if (node == nullptr)
+        {
+            node = new (::operator new(cls == 0 ? SmallNodeSize : LargeNodeSize)) Node;
+            node->_class = cls;
+            return node;
+        }
+        cache._free[cls] = node->_next.load(std::memory_order_relaxed);
+        return node;
+    }
+    void FreeNode(Node *node)
+    {
+        std::atomic<Node *> &head = _free[node->_class];
+        Node *old = head.load(std::memory_order_relaxed);
+        do
+        {
+            node->_next.store(old, std::memory_order_relaxed);
+        } while (!head.compare_exchange_weak(old, node, std::memory_order_release, std::memory_order_relaxed));
+    }
+    static void DeleteList(Node *node)
+    {
+        while (node != nullptr)
+        {
+            Node *next = node->_next.load(std::memory_order_relaxed);
+            ::operator delete(node);
+            node = next;
+        }
+    }
+    template <class Fn>
+    static void Invoke(void *p) { (*static_cast<Fn *>(p))(); }
+    template <class Fn>
+    static void Destroy(void *p) { static_cast<Fn *>(p)->~Fn(); }
+    template <class Fn>
+    static void InvokeBoxed(void *p) { (**static_cast<Fn **>(p))(); }
+    template <class Fn>
+    static void DestroyBoxed(void *p) { delete *static_cast<Fn **>(p); }
+
+public:
+    TaskQueue() : _head(&_stub), _tail(&_stub)
+    {
+        _free[0] = nullptr;
+        _free[1] = nullptr;
+    }
+    ~TaskQueue()
+    {
+        Node *node;
+        while ((node = Pop()) != nullptr)
+        {
+            node->_destroy(node->Storage());
+            ::operator delete(node);
+        }
+        DeleteList(_free[0].load());
+        DeleteList(_free[1].load());
+    }
+    // 多个线程都可以调用，闭包移动到节点中
+    template <class F>
+    void Push(F &&task)
+    {
+        typedef typename std::decay<F>::type Fn;
+        Node *node;
+        if (sizeof(Fn) <= MaxInlineSize && alignof(Fn) <= 16)
+        {
+            node = AllocNode(sizeof(Fn) <= SmallNodeSize - HeaderSize ? 0 : 1);
+            new (node->Storage()) Fn(std::forward<F>(task));
+            node->_invoke = &Invoke<Fn>;
+            node->_destroy = &Destroy<Fn>;
+        }
+        else
+        {
+            // 节点放不下，闭包在堆上申请，节点中只保存指针
+            node = AllocNode(0);
+            *static_cast<Fn **>(node->Storage()) = new Fn(std::forward<F>(task));
+            node->_invoke = &InvokeBoxed<Fn>;
+            node->_destroy = &DestroyBoxed<Fn>;
+        }
+        PushNode(node);
+    }
+    // 执行并回收取出的节点，只有消费者调用
+    void Run(Node *node)
+    {
+        node->_invoke(node->Storage());
+        node->_destroy(node->Storage());
+        FreeNode(node);
+    }
+    // 当前最后一个入队的节点，消费者用它确定这一轮要执行到哪里，之后入队的任务留到下一轮
+    Node *Last() { return _head.load(std::memory_order_acquire); }
+    // 只有消费者调用，队列为空（或者生产者还没有挂好节点）时返回nullptr
+    Node *Pop()
+    {
+        Node *tail = _tail;
+        Node *next = tail->_next.load(std::memory_order_acquire);
+        if (tail == &_stub)
+        {
+            if (next == nullptr)
+                return nullptr;
+            _tail = next;
+            tail = next;
+            next = next->_next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr)
+        {
+            _tail = next;
+            return tail;
+        }
+        if (tail != _head.load(std::memory_order_acquire))
+            return nullptr; // 有生产者正在入队
+        // 只剩最后一个节点，把占位节点放到后面才能把它取出来
+        PushNode(&_stub);
+        next = tail->_next.load(std::memory_order_acquire);
+        if (next != nullptr)
+        {
+            _tail = next;
+            return tail;
+        }
+        return nullptr;
     }
 };
 
@@ -865,22 +2341,47 @@ private:
     std::thread::id _thread_id;              // 线程id
     int _event_fd;                           // eventfd唤醒IO事件监控所导致的阻塞
     std::unique_ptr<Channel> _event_channel; // eventfd对应的channel
-    Poller _poller;                          // 要管理事件的epoll模型
-    /*由于任务池有可能被多个线程所访问，所以在访问任务池的时候，要给任务池加锁*/
-    std::mutex _mutex;                       // 任务池的锁
-    std::vector<TaskFunc> _tasks;            // 任务池
+    std::unique_ptr<Poller> _poller;         // 事件监控（epoll或者io_uring）
+    /*任务池会被多个线程访问，这里使用无锁队列，入队不需要加锁
+      eventfd只在队列从空闲变为有任务的时候写一次：第一个入队的线程把_wakeup_pending置为true并写eventfd，
+      之后入队的线程看到已经是true就不再写，EventLoop开始执行任务之前把它清为false*/
+    TaskQueue _tasks;                        // 任务池
+    std::atomic<bool> _wakeup_pending;       // 是否已经写过eventfd还没有开始执行任务
+    std::atomic<int64_t> _task_depth;        // 任务池中的任务个数
+    std::atomic<int64_t> _active_conns;      // 分给本loop还没有释放的连接数，负载均衡用
+    std::vector<Connection *> _conns;        // 本loop上已经建立还没有释放的连接，只在loop线程内访问，迁移时从这里挑选
+    std::atomic<uint64_t> _task_enqueued;    // 入队的任务总数
+    std::atomic<uint64_t> _wakeups;          // 写eventfd的次数
+    std::atomic<uint64_t> _wakeups_saved;    // 因为已经写过eventfd而省掉的写的次数
+    std::vector<Channel *> _actives;         // 本轮就绪的Channel，每轮清空后复用
+    /*忙轮询：没有就绪事件的时候先用0超时反复检查，超过预算还没有事件再阻塞等待，省掉阻塞和唤醒的延迟，代价是空转的CPU
+      预算从上一次有事件开始计算，所以繁忙的时候一直轮询，空闲超过预算之后自动退回阻塞等待*/
+    std::atomic<uint32_t> _busy_poll_us;     // 忙轮询的预算（微秒），0表示不启用
+    uint64_t _last_event_ns;                 // 上一次事件监控拿到事件的时间，只在loop线程内访问
+    std::atomic<uint64_t> _polls;            // 事件监控的轮数
+    std::atomic<uint64_t> _busy_hits;        // 轮询期间就拿到事件的轮数（省掉了一次阻塞和唤醒）
+    std::atomic<uint64_t> _busy_misses;      // 轮询超过预算后阻塞等待的轮数
+    std::atomic<uint64_t> _spin_ns;          // 轮询空转的时间
+    std::atomic<uint64_t> _block_ns;         // 阻塞等待的时间
+    uint64_t _loop_time_ms;                  // 本轮事件监控返回的时间（毫秒），本轮的事件处理都用这个时间，不用每次都获取
+    std::atomic<bool> _quit;                 // 退出事件循环的标志
     TimerWheel _timer_wheel;                 // 时间轮
+    BufferPool _buffer_pool;                 // 本线程内Buffer使用的内存块池
 private:
     void RunAllTask() // 执行任务池中的所有任务
     {
-        std::vector<TaskFunc> functor;
-        { // RAII的模式管理锁
-            std::unique_lock<std::mutex> lck(_mutex);
-            _tasks.swap(functor);
-        }
-        for (auto f : functor)
+        // 先清除唤醒标志再取任务，之后入队的任务会重新写eventfd，不会被遗漏
+        _wakeup_pending.exchange(false, std::memory_order_acq_rel);
+        // 只执行到现在为止入队的任务，任务中新压入的任务留到下一轮，先处理其他事件
+        TaskQueue::Node *last = _tasks.Last();
+        TaskQueue::Node *node;
+        while ((node = _tasks.Pop()) != nullptr)
         {
-            f();
+            _task_depth.fetch_sub(1, std::memory_order_relaxed);
+            bool done = (node == last);
+            _tasks.Run(node);
+            if (done)
+                break;
         }
     }
     /*这里的eventfd的作用是唤醒IO事件监控所导致的阻塞，IO事件监控的时候，如果没有任务，会在调用Poller::Poll时阻塞，
@@ -907,6 +2408,48 @@ private:
             abort();
         }
     }
+    static uint64_t NowNs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    void BlockingPoll()
+    {
+        uint64_t start = NowNs();
+        _poller->Poll(&_actives, -1);
+        _block_ns.fetch_add(NowNs() - start, std::memory_order_relaxed);
+    }
+    void Poll() // 事件监控，启用忙轮询的时候先轮询再阻塞
+    {
+        _polls.fetch_add(1, std::memory_order_relaxed);
+        uint32_t budget_us = _busy_poll_us.load(std::memory_order_relaxed);
+        if (budget_us == 0)
+            return BlockingPoll();
+        // 只轮询到上一次有事件的时间加上预算为止，事件处理花的时间也算在预算里；已经超过的话直接阻塞
+        uint64_t start = NowNs(), now = start;
+        uint64_t deadline = _last_event_ns + (uint64_t)budget_us * 1000;
+        while (now < deadline)
+        {
+            _poller->Poll(&_actives, 0);
+            now = NowNs();
+            if (!_actives.empty())
+            {
+                _busy_hits.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+            sched_yield(); // 独占CPU时立即返回；和其他线程共用CPU时让对端有机会运行，不会空转到时间片用完
+        }
+        _spin_ns.fetch_add(now - start, std::memory_order_relaxed);
+        if (_actives.empty())
+        {
+            _busy_misses.fetch_add(1, std::memory_order_relaxed);
+            BlockingPoll();
+            now = NowNs();
+        }
+        if (!_actives.empty())
+            _last_event_ns = now;
+    }
     void WeakUpEventFd() // 唤醒eventfd
     {
         // 实际上就是向eventfd中写入一个数据
@@ -922,39 +2465,105 @@ private:
     }
 
 public:
-    EventLoop()
+    EventLoop(PollerType type = POLLER_EPOLL)
         : _thread_id(std::this_thread::get_id()),
           _event_fd(CreateEventfd()),
           _event_channel(new Channel(_event_fd, this)),
-          _timer_wheel(this)
+          _poller(Poller::Create(type)),
+          _wakeup_pending(false), _task_depth(0), _active_conns(0), _task_enqueued(0), _wakeups(0), _wakeups_saved(0),
+          _busy_poll_us(0), _last_event_ns(0), _polls(0), _busy_hits(0), _busy_misses(0), _spin_ns(0), _block_ns(0),
+          _loop_time_ms(NowNs() / 1000000), _quit(false), _timer_wheel(this)
     {
         // 给_event_channel添加读回调函数
         _event_channel->SetReadCallback(std::bind(&EventLoop::ReadEventFd, this));
         // 开启读事件监控
         _event_channel->EnableRead();
+        // 本线程内的Buffer从当前loop的池中租用存储空间
+        BufferPool::SetCurrent(&_buffer_pool);
     }
-    void RunInLoop(const TaskFunc &cb) // 判断当前任务是否在当前线程，如果在就执行，不在就压入任务队列
+    ~EventLoop()
+    {
+        close(_event_fd);
+        if (BufferPool::IsCurrent(&_buffer_pool))
+            BufferPool::SetCurrent(nullptr);
+    }
+    // 任务可以是任意的可调用对象，直接移动到任务队列的节点中，不会包装成std::function
+    template <class F>
+    void RunInLoop(F &&cb) // 判断当前任务是否在当前线程，如果在就执行，不在就压入任务队列
     {
         if (IsInLoop())
         {
             // LOG(DEBUG, "当前任务在同一个线程，直接执行");
-            return cb();
+            cb();
         }
         else
         {
             // LOG(DEBUG, "当前任务在不在同一个线程，压入任务池");
-            QueueInLoop(cb);
+            QueueInLoop(std::forward<F>(cb));
         }
     }
-    void QueueInLoop(const TaskFunc &cb) // 将操作压入任务队列
+    template <class F>
+    void QueueInLoop(F &&cb) // 将操作压入任务队列，任务是移动进去的，捕获的数据不会被拷贝
     {
         // 1. 将操作压入任务队列
+        _task_depth.fetch_add(1, std::memory_order_relaxed);
+        _task_enqueued.fetch_add(1, std::memory_order_relaxed);
+        _tasks.Push(std::forward<F>(cb));
+        // 2. 唤醒由于没有事件发生导致的事件监控阻塞，已经唤醒过了就不需要再写eventfd
+        if (_wakeup_pending.exchange(true, std::memory_order_acq_rel) == false)
         {
-            std::unique_lock<std::mutex> lck(_mutex);
-            _tasks.push_back(cb);
+            _wakeups.fetch_add(1, std::memory_order_relaxed);
+            WeakUpEventFd();
+        }
+        else
+        {
+            _wakeups_saved.fetch_add(1, std::memory_order_relaxed);
         }
-        // 2. 唤醒由于没有事件发生导致的事件监控阻塞
-        WeakUpEventFd();
+    }
+    // 任务池的统计信息，可以在任意线程调用
+    struct TaskStats
+    {
+        int64_t depth;          // 当前任务池中的任务个数
+        uint64_t enqueued;      // 入队的任务总数
+        uint64_t wakeups;       // 写eventfd的次数
+        uint64_t wakeups_saved; // 省掉的写eventfd的次数
+    };
+    TaskStats GetTaskStats()
+    {
+        TaskStats stats;
+        stats.depth = _task_depth.load(std::memory_order_relaxed);
+        stats.enqueued = _task_enqueued.load(std::memory_order_relaxed);
+        stats.wakeups = _wakeups.load(std::memory_order_relaxed);
+        stats.wakeups_saved = _wakeups_saved.load(std::memory_order_relaxed);
+        return stats;
+    }
+    // 负载计数，relaxed读写，只是负载均衡的参考，可以在任意线程读取
+    int64_t ActiveConnections() { return _active_conns.load(std::memory_order_relaxed); }
+    int64_t PendingTasks() { return _task_depth.load(std::memory_order_relaxed); }
+    void ConnectionAdded() { _active_conns.fetch_add(1, std::memory_order_relaxed); }   // 为连接选中这个loop时调用，可以在任意线程
+    void ConnectionRemoved() { _active_conns.fetch_sub(1, std::memory_order_relaxed); } // 连接释放时在loop线程内调用
+    // 本loop上的连接，连接自己在建立、迁入时加入，释放、迁出时移除；只能在loop线程内访问
+    std::vector<Connection *> &Connections() { return _conns; }
+    // 设置忙轮询的预算（微秒），0表示关闭，可以在任意线程调用
+    void SetBusyPoll(uint32_t usec) { _busy_poll_us.store(usec, std::memory_order_relaxed); }
+    // 事件监控的统计信息，用来权衡忙轮询花掉的CPU和省掉的阻塞，可以在任意线程调用
+    struct PollStats
+    {
+        uint64_t polls;       // 事件监控的轮数
+        uint64_t busy_hits;   // 轮询期间拿到事件的轮数
+        uint64_t busy_misses; // 轮询超过预算后阻塞等待的轮数
+        uint64_t spin_ns;     // 轮询空转的时间（额外消耗的CPU）
+        uint64_t block_ns;    // 阻塞等待的时间
+    };
+    PollStats GetPollStats()
+    {
+        PollStats stats;
+        stats.polls = _polls.load(std::memory_order_relaxed);
+        stats.busy_hits = _busy_hits.load(std::memory_order_relaxed);
+        stats.busy_misses = _busy_misses.load(std::memory_order_relaxed);
+        stats.spin_ns = _spin_ns.load(std::memory_order_relaxed);
+        stats.block_ns = _block_ns.load(std::memory_order_relaxed);
+        return stats;
     }
     bool IsInLoop() // 判断当前线程是否是EventLoop对应的线程
     {
@@ -965,15 +2574,16 @@ public:
         assert(_thread_id == std::this_thread::get_id());
     }
 
-    void Start() // 事件监控-》就绪事件处理-》执行任务
+    void Start() // 事件监控-》就绪事件处理-》执行任务，调用Quit之后处理完当前这一轮再返回
     {
-        while (true)
+        while (_quit.load(std::memory_order_acquire) == false)
         {
-            // 1. 事件监控
-            std::vector<Channel *> actives;
-            _poller.Poll(&actives);
+            // 1. 事件监控，就绪数组每轮复用，不重新申请
+            _actives.clear();
+            Poll();
+            _loop_time_ms = NowNs() / 1000000;
             // 2. 事件处理
-            for (auto &a : actives)
+            for (auto &a : _actives)
             {
                 a->HandleEvent();
             }
@@ -981,97 +2591,370 @@ public:
             RunAllTask();
         }
     }
-    void UpdateEvent(Channel *channel) { _poller.UpdateEvent(channel); } // 添加/更新事件监控
-    void RemoveEvent(Channel *channel) { _poller.RemoveEvent(channel); } // 移除事件监控
-    void TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb) { return _timer_wheel.TimerAdd(id, delay, cb); }
+    // 退出事件循环，可以在任意线程调用，在其他线程调用时通过eventfd唤醒阻塞的事件监控
+    // 已经入队的任务会在退出前的这一轮中执行
+    void Quit()
+    {
+        _quit.store(true, std::memory_order_release);
+        if (IsInLoop() == false)
+            WeakUpEventFd();
+    }
+    void UpdateEvent(Channel *channel) { _poller->UpdateEvent(channel); } // 添加/更新事件监控
+    void RemoveEvent(Channel *channel) { _poller->RemoveEvent(channel); } // 移除事件监控
+    PollerType GetPollerType() { return _poller->Type(); }                // 实际使用的事件监控方式
+    bool SupportCompletion(CompletionMode mode) { return _poller->SupportCompletion(mode); }
+    void TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb) { return _timer_wheel.TimerAdd(id, TimerWheel::SecondsToMs(delay), cb); } // delay的单位是秒
+    void TimerAddMs(uint64_t id, uint32_t delay, const TaskFunc &cb) { return _timer_wheel.TimerAdd(id, delay, cb); }      // delay的单位是毫秒
+    // 使用者自己持有定时任务节点，不需要申请内存也不需要查表，只能在EventLoop线程内调用，delay的单位是毫秒
+    void TimerStart(TimerTask *timer, uint32_t delay) { _timer_wheel.TimerStart(timer, delay); }
+    void TimerRestart(TimerTask *timer) { _timer_wheel.TimerRestart(timer); }
+    void TimerStop(TimerTask *timer) { _timer_wheel.TimerStop(timer); }
+    uint64_t LoopTimeMs() { return _loop_time_ms; } // 本轮事件监控返回的时间（CLOCK_MONOTONIC，毫秒），只能在EventLoop线程内调用
     void TimerRefresh(uint64_t id) { return _timer_wheel.TimerRefresh(id); }
     void TimerCancel(uint64_t id) { return _timer_wheel.TimerCancel(id); }
     bool HaveTimer(uint64_t id) { return _timer_wheel.HaveTimer(id); }
+    // 内存块池的统计信息和高水位设置，只能在EventLoop线程内调用
+    const BufferPool::Stats &BufferPoolStats() { return _buffer_pool.GetStats(); }
+    double BufferPoolHitRate() { return _buffer_pool.HitRate(); }
+    void SetBufferPoolHighWater(uint64_t bytes) { _buffer_pool.SetHighWater(bytes); }
+};
+
+/**
+ * CpuAffinity：线程绑核和NUMA内存位置
+ *  绑核之后线程不会被调度到其他核上，缓存一直是热的
+ *  线程先绑核再创建EventLoop，loop的内存（包括Buffer的内存块池）按首次访问分配在本地NUMA节点上；
+ *  还可以把线程的内存策略设置为优先本地节点，之后这个线程申请的内存都尽量放在本地节点
+ */
+class CpuAffinity
+{
+public:
+    static bool PinCurrentThread(int cpu) // 把当前线程绑定到cpu上
+    {
+        if (cpu < 0 || cpu >= CPU_SETSIZE)
+            return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (ret != 0)
+        {
+            LOG(ERROR, "pin thread to cpu %d error, code: %d, reason: %s", cpu, ret, strerror(ret));
+            return false;
+        }
+        return true;
+    }
+    static void CurrentPlacement(int *cpu, int *node) // 当前线程所在的cpu和NUMA节点
+    {
+        unsigned c = 0, n = 0;
+        if (syscall(SYS_getcpu, &c, &n, nullptr) < 0)
+        {
+            *cpu = *node = -1;
+            return;
+        }
+        *cpu = c;
+        *node = n;
+    }
+    static bool PreferLocalMemory(int node) // 当前线程之后申请的内存优先放在node上（MPOL_PREFERRED）
+    {
+        const int MpolPreferred = 1;
+        if (node < 0 || node >= 64)
+            return false;
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_set_mempolicy, MpolPreferred, &mask, sizeof(mask) * 8) < 0)
+        {
+            LOG(ERROR, "set mempolicy to node %d error, code: %d, reason: %s", node, errno, strerror(errno));
+            return false;
+        }
+        return true;
+    }
 };
 
 /**
  * LoopThread：一个Thread对应一个Loop，这也就是本项目设计的核心思想（One Thread One Loop）
+ * 可以指定线程绑定的cpu，线程先绑核（以及设置本地内存优先）再创建EventLoop
 */
 class LoopThread
 {
 private:
-    std::thread _thread; // EventLoop对应的线程
-    EventLoop *_loop;    // EventLoop对象的指针（在新线程内部实例化）
+    // 成员的初始化顺序就是声明顺序，_thread一定要放在最后，保证线程启动的时候其他成员已经初始化好了
     std::mutex _mutex; // 一个互斥锁
     std::condition_variable _cond; // 条件变量
+    EventLoop *_loop;    // EventLoop对象的指针（在新线程内部实例化）
+    bool _exited;        // EventLoop已经退出（_loop指向的对象即将销毁）
+    PollerType _poller_type; // EventLoop使用的事件监控方式
+    int _cpu;            // 绑定的cpu，小于0表示不绑定；线程启动之后是实际所在的cpu
+    int _node;           // 线程启动之后所在的NUMA节点
+    bool _numa_local;    // 是否把线程的内存策略设置为优先本地节点
+    std::thread _thread; // EventLoop对应的线程
 
     private:
     // 这是一个线程入口函数，在这个函数里面实例化EventLoop对象，唤醒cond上有可能阻塞的线程
     void ThreadEntry()
     {
-        EventLoop loop; // 这里把loop在栈上实例化，然后把指针赋值给_loop，是为了让loop的生命周期随栈
+        if (_cpu >= 0)
+            CpuAffinity::PinCurrentThread(_cpu);
+        int cpu, node;
+        CpuAffinity::CurrentPlacement(&cpu, &node);
+        if (_numa_local)
+            CpuAffinity::PreferLocalMemory(node);
+        EventLoop loop(_poller_type); // 这里把loop在栈上实例化，然后把指针赋值给_loop，是为了让loop的生命周期随栈
+        {
+            std::unique_lock<std::mutex> lck(_mutex);
+            _cpu = cpu;
+            _node = node;
+            _loop = &loop;
+            _cond.notify_all(); // 唤醒cond上阻塞的线程
+        }
+        loop.Start();
+        std::unique_lock<std::mutex> lck(_mutex); // 持有锁的时候Stop不会再访问即将销毁的loop
+        _exited = true;
+    }
+public:
+    // cpu小于0表示不绑核，numa_local表示线程的内存优先放在所在的NUMA节点上
+    LoopThread(PollerType type = POLLER_EPOLL, int cpu = -1, bool numa_local = false)
+        : _loop(nullptr), _exited(false), _poller_type(type), _cpu(cpu), _node(-1), _numa_local(numa_local),
+          _thread(std::thread(&LoopThread::ThreadEntry, this))
+    {}
+    ~LoopThread() { Stop(); }
+    // 退出EventLoop并等待线程结束，之后GetLoop返回的指针不能再使用
+    void Stop()
+    {
+        {
+            std::unique_lock<std::mutex> lck(_mutex);
+            _cond.wait(lck, [&]() { return _loop != nullptr; });
+            if (_exited == false)
+                _loop->Quit();
+        }
+        if (_thread.joinable())
+            _thread.join();
+    }
+    EventLoop *GetLoop() 
+    { 
+        EventLoop *loop = nullptr;
+        {
+            std::unique_lock<std::mutex> lck(_mutex); // 加锁
+            _cond.wait(lck, [&]() { return _loop != nullptr; }); // 循环等待
+            loop = _loop;
+        }
+        return loop;
+    }
+    // 线程实际所在的cpu和NUMA节点（没有绑核的线程可能之后会被调度到其他cpu上）
+    int Cpu()
+    {
+        GetLoop();
+        return _cpu;
+    }
+    int Node()
+    {
+        GetLoop();
+        return _node;
+    }
+};
+
+/**
+ * LoadBalancer：主线程接收到新连接之后，决定交给哪一个从属线程处理
+ * 轮转只保证连接个数平均，长连接的负载差别很大时会有的loop很忙有的很闲，所以提供几种按负载选择的策略
+ * 负载计数是EventLoop中relaxed的原子变量，读到的是近似值，选择的时候不加锁
+ */
+enum LoadBalance
+{
+    LB_ROUND_ROBIN,        // 轮转
+    LB_LEAST_CONNECTIONS,  // 连接数最少的loop
+    LB_LEAST_PENDING_TASKS,// 任务池中积压的任务最少的loop（任务数相同的时候选连接少的）
+    LB_IP_HASH             // 按客户端IP哈希，同一个客户端的连接总是落在同一个loop上，利于缓存亲和
+};
+class LoadBalancer
+{
+public:
+    virtual ~LoadBalancer() {}
+    // 为新连接fd选择一个loop，loops不为空，只在主线程中调用
+    virtual EventLoop *Select(const std::vector<EventLoop *> &loops, int fd) = 0;
+    static LoadBalancer *Create(LoadBalance type);
+};
+class RoundRobinBalancer : public LoadBalancer
+{
+private:
+    size_t _next;
+
+public:
+    RoundRobinBalancer() : _next(0) {}
+    EventLoop *Select(const std::vector<EventLoop *> &loops, int /*fd*/) override
+    {
+        if (_next >= loops.size())
+            _next = 0;
+        return loops[_next++];
+    }
+};
+// 按负载选择最小的loop，负载相同时从上一次选中的下一个开始找，避免空闲的时候连接都落在第一个loop上
+class LeastLoadBalancer : public LoadBalancer
+{
+private:
+    bool _by_tasks; // true按积压的任务数，false按连接数
+    size_t _start;
+
+public:
+    LeastLoadBalancer(bool by_tasks) : _by_tasks(by_tasks), _start(0) {}
+    EventLoop *Select(const std::vector<EventLoop *> &loops, int /*fd*/) override
+    {
+        size_t n = loops.size();
+        size_t best = _start % n;
+        int64_t best_tasks = _by_tasks ? loops[best]->PendingTasks() : 0;
+        int64_t best_conns = loops[best]->ActiveConnections();
+        for (size_t k = 1; k < n; ++k)
+        {
+            size_t i = (_start + k) % n;
+            int64_t tasks = _by_tasks ? loops[i]->PendingTasks() : 0;
+            int64_t conns = loops[i]->ActiveConnections();
+            if (tasks < best_tasks || (tasks == best_tasks && conns < best_conns))
+            {
+                best = i;
+                best_tasks = tasks;
+                best_conns = conns;
+            }
+        }
+        _start = best + 1;
+        return loops[best];
+    }
+};
+class IpHashBalancer : public LoadBalancer
+{
+private:
+    RoundRobinBalancer _fallback; // 拿不到对端地址的时候轮转
+
+public:
+    EventLoop *Select(const std::vector<EventLoop *> &loops, int fd) override
+    {
+        struct sockaddr_storage peer;
+        socklen_t len = sizeof(peer);
+        if (fd < 0 || getpeername(fd, (struct sockaddr *)&peer, &len) < 0)
+            return _fallback.Select(loops, fd);
+        uint64_t hash = 14695981039346656037ULL; // FNV-1a，只哈希IP不哈希端口
+        const unsigned char *p;
+        size_t n;
+        if (peer.ss_family == AF_INET6)
         {
-            std::unique_lock<std::mutex> lck(_mutex);
-            _loop = &loop;
-            _cond.notify_all(); // 唤醒cond上阻塞的线程
+            p = (const unsigned char *)&((struct sockaddr_in6 *)&peer)->sin6_addr;
+            n = sizeof(struct in6_addr);
         }
-        loop.Start();
-    }
-public:
-    LoopThread() : _loop(nullptr), _thread(std::thread(&LoopThread::ThreadEntry, this))
-    {}
-    EventLoop *GetLoop() 
-    { 
-        EventLoop *loop = nullptr;
+        else
         {
-            std::unique_lock<std::mutex> lck(_mutex); // 加锁
-            _cond.wait(lck, [&]() { return _loop != nullptr; }); // 循环等待
-            loop = _loop;
+            p = (const unsigned char *)&((struct sockaddr_in *)&peer)->sin_addr;
+            n = sizeof(struct in_addr);
         }
-        return loop;
+        for (size_t i = 0; i < n; ++i)
+            hash = (hash ^ p[i]) * 1099511628211ULL;
+        return loops[hash % loops.size()];
     }
 };
+inline LoadBalancer *LoadBalancer::Create(LoadBalance type)
+{
+    switch (type)
+    {
+    case LB_LEAST_CONNECTIONS:
+        return new LeastLoadBalancer(false);
+    case LB_LEAST_PENDING_TASKS:
+        return new LeastLoadBalancer(true);
+    case LB_IP_HASH:
+        return new IpHashBalancer();
+    default:
+        return new RoundRobinBalancer();
+    }
+}
 
 /**
  * LoopThreadPool：一个线程池，里面管理当前进程的所有线程，包括一个主线程（用于接收连接）和若干个从属线程（用于处理事件）
  * 提供的功能：1. 创建从属线程，管理从属线程
- *           2. 为所有的从属线程分配对应的任务（这里采用轮转的策略分配）
+ *           2. 为所有的从属线程分配对应的任务（由LoadBalancer选择，默认轮转）
  * 后续改进：这里的线程池应该是只有一个的，后面考虑设置为单例模式
 */
 class LoopThreadPool
 {
 private:
     EventLoop *_main_loop; // 主线程
-    int _next_loop_index; // 下一个从属线程的索引
+    std::unique_ptr<LoadBalancer> _balancer; // 新连接分配给哪个从属线程
     int _thread_num; // 从属线程个数
     std::vector<LoopThread *> _threads; // 从属线程指针
     std::vector<EventLoop *> _loops;
+    PollerType _poller_type; // 从属线程的事件监控方式
+    uint32_t _busy_poll_us; // 从属线程忙轮询的预算
+    std::vector<int> _cpus; // 从属线程依次绑定的cpu，为空表示不绑核
+    bool _numa_local; // 从属线程的内存优先放在本地NUMA节点
 
 public:
-    LoopThreadPool(EventLoop *main_loop) : _main_loop(main_loop), _next_loop_index(0), _thread_num(0) {}
-    void SetThreadNum(int num) { _thread_num = num; } // 设置从属线程个数
-    void Create() // 创建从属线程
+    LoopThreadPool(EventLoop *main_loop, PollerType type = POLLER_EPOLL) : _main_loop(main_loop), _balancer(new RoundRobinBalancer()), _thread_num(0), _poller_type(type), _busy_poll_us(0), _numa_local(false) {}
+    ~LoopThreadPool() { Stop(); }
+    void Stop() // 退出所有从属线程的EventLoop并等待线程结束
+    {
+        for (auto &thread : _threads)
+        {
+            thread->Stop();
+            delete thread;
+        }
+        _threads.clear();
+        _loops.clear();
+    }
+    // 设置从属线程个数，小于0表示使用CPU核数，0表示不创建从属线程（所有连接都在主线程处理），在Create之前调用
+    void SetThreadNum(int num)
+    {
+        if (num < 0)
+            num = std::max(1u, std::thread::hardware_concurrency());
+        _thread_num = num;
+    }
+    int LoopCount() { return _loops.empty() ? 1 : _loops.size(); } // 实际处理连接的loop个数
+    // 第i个从属线程绑定到cpus[i % cpus.size()]上，在Create之前调用
+    void SetCpuAffinity(const std::vector<int> &cpus) { _cpus = cpus; }
+    void SetNumaLocal(bool on) { _numa_local = on; }
+    // 每个从属线程所在的cpu和NUMA节点
+    struct Placement
+    {
+        int cpu;
+        int node;
+    };
+    std::vector<Placement> GetPlacement()
+    {
+        std::vector<Placement> placement;
+        for (auto &thread : _threads)
+            placement.push_back(Placement{thread->Cpu(), thread->Node()});
+        return placement;
+    }
+    void SetBusyPoll(uint32_t usec) // 设置从属线程的忙轮询，之后创建的线程也使用这个设置
+    {
+        _busy_poll_us = usec;
+        for (auto &loop : _loops)
+            loop->SetBusyPoll(usec);
+    }
+    const std::vector<EventLoop *> &GetLoops() { return _loops; }
+    void Create() // 创建从属线程，重复调用不会再创建
     {
-        if(_thread_num > 0) 
+        if(_thread_num > 0 && _threads.empty()) 
         {
             _threads.resize(_thread_num);
             _loops.resize(_thread_num);
             for(int i = 0; i < _thread_num; i++)
             {
-                _threads[i] = new LoopThread();
+                int cpu = _cpus.empty() ? -1 : _cpus[i % _cpus.size()];
+                _threads[i] = new LoopThread(_poller_type, cpu, _numa_local);
                 _loops[i] = _threads[i]->GetLoop();
+                _loops[i]->SetBusyPoll(_busy_poll_us);
             }
         }
         
     }
-    EventLoop *GetNextLoop()
+    // 设置新连接的分配策略，在主线程中调用
+    void SetLoadBalancer(LoadBalance type) { _balancer.reset(LoadBalancer::Create(type)); }
+    void SetLoadBalancer(LoadBalancer *balancer) { _balancer.reset(balancer); } // 自定义策略，线程池负责释放
+    // fd是新连接的描述符，按对端地址选择的策略需要用到，没有从属线程时返回主线程
+    EventLoop *GetNextLoop(int fd = -1)
     {
-        EventLoop *loop = _main_loop;
-        if (!_loops.empty())
-        {
-            loop = _loops[_next_loop_index];
-            _next_loop_index = (_next_loop_index + 1) % _thread_num;
-        }
-        return loop;
+        if (_loops.empty())
+            return _main_loop;
+        return _balancer->Select(_loops, fd);
     }
 
 };
 
+const static uint64_t EdgeTriggeredBudget = 1 << 20; // 边缘触发时一次事件最多读/写的字节数，超过之后让出给其他连接
+
 /**
  * Connection类:每个连接都有一个对应的连接对象，这里封装了网络连接的读写事件监控，定时器管理，以及读写事件的处理
  *             包括关联的loop和socket对象和连接对应的上下文
@@ -1084,17 +2967,26 @@ class Connection : public std::enable_shared_from_this<Connection>
     using MessageCallback = std::function<void(const PtrConnection &, Buffer *)>;
     using ClosedCallback = std::function<void(const PtrConnection &)>;
     using AnyEventCallback = std::function<void(const PtrConnection &)>;
+    using HighWaterMarkCallback = std::function<void(const PtrConnection &, uint64_t)>;
+    using LowWaterMarkCallback = std::function<void(const PtrConnection &)>;
+    using WriteCompleteCallback = std::function<void(const PtrConnection &)>;
 
 private:
     uint64_t _conn_id;             // Connection对象的唯一id（同时作为timerid）
     int _sockfd;                   // 连接关联的文件描述符
     bool _enable_inactive_release; // 启动非活跃连接销毁标志，默认是false
-    EventLoop *_loop;              // 连接所关联的一个loop
+    TimerTask _idle_timer;         // 非活跃连接销毁的定时任务
+    uint32_t _idle_timeout;        // 非活跃连接的超时时间（毫秒）
+    uint64_t _last_active;         // 最后一次有事件的时间（毫秒），定时任务到期时根据它判断是否真的超时
+    bool _draining;                // 服务器正在退出，处理完已经收到的数据、发送完输出队列之后关闭
+    std::atomic<EventLoop *> _loop; // 连接所关联的一个loop，迁移时会修改，通过GetLoop读取
+    std::atomic<uint32_t> _queued;  // 压入任务池还没有执行的任务数，最高位表示正在迁移
+    size_t _loop_index;            // 在所在loop的连接列表中的位置，NotLinked表示不在列表中
     ConnStatu _statu;              // 连接的状态
     Socket _socket;                // 连接的套接字管理
     Channel _channel;              // 连接的事件管理
     Buffer _in_buffer;             // 输入缓冲区
-    Buffer _out_buffer;            // 输出缓冲区
+    OutputQueue _out_buffer;       // 输出缓冲区（由多个数据段组成的输出队列）
     Any _context;                  // 请求处理的上下文
 
     // 回调函数
@@ -1105,13 +2997,94 @@ private:
 
     ClosedCallback _server_closed_callback; // 这个是组件内设置的
 
+    // 输出缓冲区的背压控制：待发送数据超过高水位时通知使用者暂停生产，降到低水位以下时通知恢复
+    uint64_t _high_water_mark;      // 高水位，0表示不启用
+    uint64_t _low_water_mark;       // 低水位
+    bool _over_high_water;          // 当前是否处于高水位之上
+    bool _pause_read_on_high_water; // 超过高水位的时候是否暂停读事件监控
+    /* 边缘触发模式：每次事件都读/写到EAGAIN为止，单次事件读写的数据量超过上限就把剩下的工作压入任务池，
+       先处理这一轮其他连接的事件，避免一个数据量很大的连接饿死其他连接 */
+    bool _edge_triggered;
+    bool _recv_completion; // Poller支持的时候由Poller直接接收数据（io_uring多次触发的recv），见CompletionMode
+    HighWaterMarkCallback _high_water_callback;
+    LowWaterMarkCallback _low_water_callback;
+    WriteCompleteCallback _write_complete_callback;
+
+private:
+    // 跨线程发送少量数据的任务，数据拷贝在闭包中
+    const static size_t InlineSendSize = 192;
+    struct InlineSendTask
+    {
+        Connection *_conn;
+        uint32_t _len;
+        char _data[InlineSendSize];
+        InlineSendTask(Connection *conn, const char *data, size_t len) : _conn(conn), _len(len) { memcpy(_data, data, len); }
+        void operator()() { _conn->SendInLoop(_data, _len); }
+    };
+    /* 连接可以在loop之间迁移：压入任务池的任务都计入_queued，有任务没有执行的时候不迁移，
+       迁移期间（最高位被置位）入队的线程等迁移完成再读取新的loop，这样任务总是在连接所在的loop中执行，顺序也不会乱 */
+    const static uint32_t MigratingFlag = 1u << 31;
+    const static size_t NotLinked = (size_t)-1;
+    // 加入/移出所在loop的连接列表，在loop线程内调用；移出时用最后一个连接填补空位
+    void LinkToLoop()
+    {
+        std::vector<Connection *> &conns = GetLoop()->Connections();
+        _loop_index = conns.size();
+        conns.push_back(this);
+    }
+    void UnlinkFromLoop()
+    {
+        if (_loop_index == NotLinked)
+            return;
+        std::vector<Connection *> &conns = GetLoop()->Connections();
+        conns[_loop_index] = conns.back();
+        conns[_loop_index]->_loop_index = _loop_index;
+        conns.pop_back();
+        _loop_index = NotLinked;
+    }
+    template <class Fn>
+    struct QueuedTask
+    {
+        Connection *_conn;
+        Fn _fn;
+        QueuedTask(Connection *conn, Fn &&fn) : _conn(conn), _fn(std::move(fn)) {}
+        void operator()()
+        {
+            // 执行之前减计数：任务中连接可能被释放，迁移也是在这个线程中进行的，执行期间不会发生
+            _conn->_queued.fetch_sub(1, std::memory_order_release);
+            _fn();
+        }
+    };
+    template <class F>
+    void QueueInOwnerLoop(F &&task) // 压入连接所在loop的任务池
+    {
+        typedef typename std::decay<F>::type Fn;
+        uint32_t queued = _queued.fetch_add(1, std::memory_order_acq_rel);
+        while (queued & MigratingFlag) // 迁移只修改几个变量，很快就会结束
+        {
+            sched_yield();
+            queued = _queued.load(std::memory_order_acquire);
+        }
+        GetLoop()->QueueInLoop(QueuedTask<Fn>(this, Fn(std::forward<F>(task))));
+    }
+    template <class F>
+    void RunInOwnerLoop(F &&task) // 在连接所在的loop线程中就直接执行，否则压入任务池
+    {
+        if (GetLoop()->IsInLoop())
+            return task();
+        QueueInOwnerLoop(std::forward<F>(task));
+    }
+
 private: // 私有的成员方法
     /*channel事件回调函数*/
     void HandleRead()
     {
-        // 1. 接收socket数据，放在缓冲区
-        char buffer[65536];
-        ssize_t ret = _socket.NonBlockRecv(buffer, sizeof(buffer) - 1);
+        if (_channel.GetCompletion() == COMPLETION_RECV)
+            return HandleRecvCompletion();
+        if (_edge_triggered)
+            return HandleReadEdge();
+        // 1. 接收socket数据，直接读取到输入缓冲区中
+        ssize_t ret = _in_buffer.ReadFd(_sockfd);
         if (ret < 0)
         {
             return ShutdownInLoop();
@@ -1120,19 +3093,102 @@ private: // 私有的成员方法
         {
             return; // 这里ret==0不是连接断开，连接断开返回-1
         }
-        _in_buffer.WriteAndPush(buffer, ret); // 把数据放入输入缓冲区
         // 2. 调用message_callback处理
         if (_in_buffer.ReadableSize() > 0)
         {
             // shared_from_this是从当前对象获取自身的shared_ptr对象
-            return _message_callback(shared_from_this(), &_in_buffer);
+            _message_callback(shared_from_this(), &_in_buffer);
+        }
+        CheckDrained();
+    }
+    // 边缘触发的读：一直读到EAGAIN，数据全部读完之后再统一处理
+    void HandleReadEdge()
+    {
+        uint64_t total = 0;
+        while (true)
+        {
+            ssize_t ret = _in_buffer.ReadFd(_sockfd);
+            if (ret < 0)
+                return ShutdownInLoop(); // 里面会先处理已经读到的数据
+            if (ret == 0)
+                break; // 已经读完了，等待下一次边缘通知
+            total += ret;
+            if (total >= EdgeTriggeredBudget)
+            {
+                // 可能还有数据，但是不会再有通知了，压入任务池稍后继续读
+                QueueInOwnerLoop(std::bind(&Connection::ContinueRead, shared_from_this()));
+                break;
+            }
+        }
+        if (total > 0 && _in_buffer.ReadableSize() > 0)
+            _message_callback(shared_from_this(), &_in_buffer);
+        CheckDrained();
+    }
+    // Poller已经接收了数据：这一轮收到的数据段依次追加到输入缓冲区，再统一处理
+    void HandleRecvCompletion()
+    {
+        bool closed = false;
+        for (const Channel::Completion &c : _channel.Completions())
+        {
+            if (c._res <= 0)
+            {
+                if (c._res < 0)
+                    LOG(ERROR, "socket recv error, code:%d, reason:%s", -c._res, strerror(-c._res));
+                closed = true; // 对端关闭或者出错，之后不会再有数据
+                break;
+            }
+            _in_buffer.WriteAndPush(c._data, c._res);
+        }
+        if (closed)
+            return ShutdownInLoop(); // 里面会先处理已经读到的数据
+        if (_in_buffer.ReadableSize() > 0)
+            _message_callback(shared_from_this(), &_in_buffer);
+        CheckDrained();
+    }
+    void CheckDrained() // 退出的时候没有未处理完的数据就关闭连接
+    {
+        if (_draining && _statu == CONNECTED && _in_buffer.ReadableSize() == 0 && _out_buffer.ReadableSize() == 0)
+            Release();
+    }
+    void ContinueRead()
+    {
+        if (_statu == CONNECTED && _channel.Readable())
+            HandleRead();
+    }
+    void ContinueWrite()
+    {
+        if (_statu != DISCONNECTED && _channel.Writeable())
+            HandleWrite();
+    }
+    // 把输出队列写入套接字，边缘触发的时候一直写到EAGAIN或者写完为止
+    ssize_t WriteOutput()
+    {
+        ssize_t ret = _out_buffer.WriteFd(_sockfd);
+        if (_edge_triggered == false || ret <= 0)
+            return ret;
+        ssize_t total = ret;
+        while (_out_buffer.Empty() == false)
+        {
+            if ((uint64_t)total >= EdgeTriggeredBudget)
+            {
+                // 套接字可能还可写，但是不会再有通知了，压入任务池稍后继续写
+                QueueInOwnerLoop(std::bind(&Connection::ContinueWrite, shared_from_this()));
+                break;
+            }
+            ret = _out_buffer.WriteFd(_sockfd);
+            if (ret < 0)
+                return ret;
+            if (ret == 0)
+                break;
+            total += ret;
         }
+        return total;
     }
     void HandleWrite()
     {
         // LOG(DEBUG, "HandleWrite in, 缓冲区大小%d", _out_buffer.ReadableSize());
-        // 1.
-        ssize_t ret = _socket.NonBlockSend(_out_buffer.ReadPosition(), _out_buffer.ReadableSize());
+        // 1. 使用writev把输出队列中的数据段写入套接字
+        ssize_t ret = WriteOutput();
         if (ret < 0)
         {
             // 此时发送失败，如果输入缓冲区有数据就先处理输入缓冲区数据，再关闭连接
@@ -1142,15 +3198,16 @@ private: // 私有的成员方法
             }
             return Release(); // 这时候就是实际关闭了
         }
-        _out_buffer.MoveReadOffset(ret);
         // LOG(DEBUG, "HandleWrite out, 缓冲区大小%d", _out_buffer.ReadableSize());
         // 如果当前连接是待关闭状态，并且发送缓冲区位0，就关闭连接
         if (_out_buffer.ReadableSize() == 0)
         {
             _channel.DisableWrite(); // 防止出现写事件busy
-            if (_statu == DISCONNECTED)
+            if (_statu == DISCONNECTING)
                 return Release();
         }
+        CheckWaterMark(ret > 0);
+        CheckDrained();
     }
     void HandleClosed() // 触发关闭事件
     {
@@ -1166,9 +3223,9 @@ private: // 私有的成员方法
     }
     void HandleEvent() // 触发任意事件
     {
-        // 1. 延迟定时销毁任务
+        // 1. 延迟定时销毁任务：只记录时间，定时任务到期的时候再按剩下的时间重新启动，不用每次事件都操作时间轮
         if (_enable_inactive_release)
-            _loop->TimerRefresh(_conn_id);
+            _last_active = GetLoop()->LoopTimeMs();
         // 2. 调用组件使用者的任意事件回调函数
         if (_anyEvent_callback)
             _anyEvent_callback(shared_from_this());
@@ -1179,7 +3236,10 @@ private: // 私有的成员方法
         // 1. 修改连接状态
         assert(_statu == CONNECTING); // 当前状态一定是半连接的
         _statu = CONNECTED;
-        // 2. 启动读事件监控
+        LinkToLoop();
+        // 2. 启动读事件监控，Poller支持的话由Poller直接接收数据
+        if (_recv_completion)
+            _channel.SetCompletion(COMPLETION_RECV);
         _channel.EnableRead();
         // 3. 调用回调函数
         if (_connected_callback)
@@ -1188,14 +3248,20 @@ private: // 私有的成员方法
     void ReleaseInLoop()
     {
         // LOG(DEBUG, "ReleaseInLoop in");
+        if (_statu == DISCONNECTED)
+            return; // 关闭和出错可能各压入一次Release，只处理第一次
         // 1. 修改连接状态
+        GetLoop()->ConnectionRemoved(); // 创建连接时已经计入，建立之前就释放的连接也要减去
+        UnlinkFromLoop();
         _statu = DISCONNECTED;
         // 2. 移除事件监控
         _channel.Remove();
-        // 3. 关闭描述符
+        // 3. 关闭描述符，缓冲区的内存块归还给本loop的池（连接对象之后在主线程中析构）
         _socket.Close();
+        _in_buffer.Release();
+        _out_buffer.Clear();
         // 4. 如果当前定时器任务在timerwheel中，就取消任务
-        if (_loop->HaveTimer(_conn_id))
+        if (_idle_timer.Linked())
             DisableInactiveReleaseInLoop();
         // 5. 调用关闭函数
         // 这里先调用用户的，为了避免先移除服务器的处理，会导致Connection对象被释放
@@ -1204,22 +3270,133 @@ private: // 私有的成员方法
         if (_server_closed_callback)
             _server_closed_callback(shared_from_this());
     }
-    void SendInLoop(Buffer &buf) // 发送数据，将要发送的数据拷贝到输出缓冲区，启动写事件监控
+    bool OutputIdle() { return _out_buffer.Empty() && _channel.Writeable() == false; }
+    // 追加数据到输出队列之后调用：如果追加之前输出队列是空闲的，就直接尝试发送一次，剩下的数据交给写事件
+    void StartWrite(bool idle)
+    {
+        ssize_t ret = 0;
+        if (idle)
+            ret = _out_buffer.WriteFd(_sockfd); // 出错的话数据留在输出队列中，由写事件处理关闭连接
+        if (_out_buffer.Empty() == false && _channel.Writeable() == false)
+        {
+            _channel.EnableWrite();
+        }
+        CheckWaterMark(ret > 0);
+    }
+    // 根据输出缓冲区中待发送数据的大小触发背压回调
+    // 高/低水位回调直接调用，这样在同一个线程中连续发送的生产者能够立刻暂停；状态在回调之前修改，回调里面再发送也不会重复触发
+    // 发送完成回调压入任务池执行，避免在回调里面继续发送导致递归
+    void CheckWaterMark(bool wrote)
+    {
+        uint64_t size = _out_buffer.ReadableSize();
+        if (_high_water_mark > 0 && _over_high_water == false && size >= _high_water_mark)
+        {
+            _over_high_water = true;
+            if (_pause_read_on_high_water && _channel.Readable())
+                _channel.DisableRead(); // 对端读得太慢，暂停接收新的请求
+            if (_high_water_callback)
+                _high_water_callback(shared_from_this(), size);
+        }
+        else if (_over_high_water && size <= _low_water_mark)
+        {
+            _over_high_water = false;
+            if (_pause_read_on_high_water && _statu == CONNECTED)
+                _channel.EnableRead();
+            if (_low_water_callback)
+                _low_water_callback(shared_from_this());
+        }
+        if (wrote && size == 0 && _write_complete_callback)
+            QueueInOwnerLoop(std::bind(_write_complete_callback, shared_from_this()));
+    }
+    void SendInLoop(const char *data, size_t len) // 发送数据，直接写不完的部分拷贝到输出缓冲区，启动写事件监控
+    {
+        struct iovec iov;
+        iov.iov_base = const_cast<char *>(data);
+        iov.iov_len = len;
+        SendVInLoop(&iov, 1);
+    }
+    // 以下几个发送接口都是接管数据的所有权，数据本身不会被拷贝
+    void SendStringInLoop(std::string &data)
+    {
+        if (_statu == DISCONNECTED)
+            return;
+        bool idle = OutputIdle();
+        _out_buffer.Append(std::move(data));
+        StartWrite(idle);
+    }
+    void SendBufferInLoop(Buffer &buf)
+    {
+        if (_statu == DISCONNECTED)
+            return;
+        bool idle = OutputIdle();
+        _out_buffer.Append(std::move(buf));
+        StartWrite(idle);
+    }
+    void SendSharedInLoop(const std::shared_ptr<const std::string> &data)
+    {
+        if (_statu == DISCONNECTED)
+            return;
+        bool idle = OutputIdle();
+        _out_buffer.Append(data);
+        StartWrite(idle);
+    }
+    // 聚集发送：输出队列为空的时候先直接writev到套接字，写不完的部分再按段拷贝到输出队列，启动写事件监控
+    void SendVInLoop(const struct iovec *iov, int iovcnt)
     {
-        // LOG(DEBUG, "SendInLoop in");
         if (_statu == DISCONNECTED)
             return;
-        _out_buffer.WriteBufferAndPush(buf);
-        if (_channel.Writeable() == false)
+        ssize_t nwrote = 0;
+        if (OutputIdle())
+        {
+            nwrote = _socket.NonBlockSendV(iov, iovcnt);
+            if (nwrote < 0)
+                nwrote = 0; // 出错的话数据留在输出队列中，由写事件处理关闭连接
+        }
+        bool wrote = nwrote > 0;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            uint64_t len = iov[i].iov_len;
+            if ((uint64_t)nwrote >= len)
+            {
+                nwrote -= len;
+                continue;
+            }
+            _out_buffer.Append(static_cast<const char *>(iov[i].iov_base) + nwrote, len - nwrote);
+            nwrote = 0;
+        }
+        if (_out_buffer.Empty() == false && _channel.Writeable() == false)
         {
             _channel.EnableWrite();
         }
-        // LOG(DEBUG, "SendInLoop out");
+        CheckWaterMark(wrote);
+    }
+    void SendFileInLoop(int fd, uint64_t offset, uint64_t len)
+    {
+        if (_statu == DISCONNECTED)
+        {
+            close(fd);
+            return;
+        }
+        bool idle = OutputIdle();
+        _out_buffer.AppendFile(fd, offset, len);
+        StartWrite(idle);
+    }
+    // 跨线程的聚集发送，数据段已经在调用线程中拷贝好了，这里直接接管到输出队列
+    void SendSegmentsInLoop(std::vector<std::string> &segments)
+    {
+        if (_statu == DISCONNECTED)
+            return;
+        bool idle = OutputIdle();
+        for (auto &seg : segments)
+            _out_buffer.Append(std::move(seg));
+        StartWrite(idle);
     }
     void ShutdownInLoop() // 关闭连接，实际上并不直接关闭，需要判断是否有数据待处理
     {
         // LOG(DEBUG, "ShutdownInLoop in");
-        _statu == DISCONNECTING; // 设置连接为半关闭状态
+        if (_statu != CONNECTED)
+            return;
+        _statu = DISCONNECTING; // 设置连接为半关闭状态，输出队列发送完之后关闭
         if (_in_buffer.ReadableSize() > 0)
         {
             if (_message_callback)
@@ -1241,7 +3418,6 @@ private: // 私有的成员方法
             Release();
             // LOG(DEBUG, "ShutdownInLoop 3");
         }
-        _statu = DISCONNECTED; // 这里等下注释
         // LOG(DEBUG, "ShutdownInLoop out");
     }
 
@@ -1250,20 +3426,45 @@ private: // 私有的成员方法
         // 1.将标志位置为true
         _enable_inactive_release = true;
         // 2.添加或延时定时任务
-        // 2.1如果存在，就延迟
-        if (_loop->HaveTimer(_conn_id))
-            _loop->TimerRefresh(_conn_id);
-        // 2.2如果不存在就添加定时销毁任务
-        else
-            _loop->TimerAdd(_conn_id, sec, std::bind(&Connection::Release, this));
+        // 2.存在就重新计时，不存在就添加定时销毁任务
+        _idle_timeout = TimerWheel::SecondsToMs(sec);
+        _last_active = GetLoop()->LoopTimeMs();
+        GetLoop()->TimerStart(&_idle_timer, _idle_timeout);
+    }
+    void OnIdleTimeout() // 定时任务到期，期间有过事件的话按剩下的时间重新启动
+    {
+        uint64_t idle = GetLoop()->LoopTimeMs() - _last_active;
+        if (idle < _idle_timeout)
+            return GetLoop()->TimerStart(&_idle_timer, _idle_timeout - idle);
+        Release();
+    }
+    void DrainInLoop()
+    {
+        if (_statu != CONNECTED)
+            return;
+        _draining = true;
+        CheckDrained();
     }
     void DisableInactiveReleaseInLoop() // 关闭非活跃连接销毁
     {
         // 1. 标志位置为false
         _enable_inactive_release = false;
         // 2. 取消定时任务
-        if (_loop->HaveTimer(_conn_id))
-            _loop->TimerCancel(_conn_id);
+        GetLoop()->TimerStop(&_idle_timer);
+    }
+    // 在新的loop中重新添加事件监控和非活跃连接的定时任务
+    void AdoptInLoop()
+    {
+        if (_statu == DISCONNECTED)
+            return; // 迁移之后、这里执行之前连接已经在新loop中释放了
+        LinkToLoop();
+        _channel.Update();
+        if (_enable_inactive_release)
+        {
+            uint64_t now = GetLoop()->LoopTimeMs();
+            uint64_t idle = now > _last_active ? now - _last_active : 0;
+            GetLoop()->TimerStart(&_idle_timer, idle < _idle_timeout ? _idle_timeout - idle : 0);
+        }
     }
     // 切换协议
     void UpgradeInLoop(const Any &context, const ConnectedCallback &conn, const MessageCallback &msg,
@@ -1279,22 +3480,30 @@ private: // 私有的成员方法
 public: // 提供给用户的接口
     /* 测试接口 */
     Buffer &inbuffer() { return _in_buffer; }
-    Buffer &outbuffer() { return _out_buffer; }
+    OutputQueue &outbuffer() { return _out_buffer; }
     /* end of  test */
 
     Connection(uint64_t id, int sockfd, EventLoop *loop)
-        : _conn_id(id), _sockfd(sockfd), _loop(loop), _enable_inactive_release(false), _statu(CONNECTING), _socket(_sockfd), _channel(_sockfd, loop)
+        : _conn_id(id), _sockfd(sockfd), _loop(loop), _enable_inactive_release(false), _idle_timeout(0), _last_active(0), _draining(false), _queued(0), _loop_index(NotLinked), _statu(CONNECTING), _socket(_sockfd), _channel(_sockfd, loop),
+          _high_water_mark(0), _low_water_mark(0), _over_high_water(false), _pause_read_on_high_water(false),
+          _edge_triggered(false), _recv_completion(false)
     {
+        _socket.NonBlack(); // 输入输出都不能阻塞在套接字上
         _channel.SetCloseCallback(std::bind(&Connection::HandleClosed, this));
         _channel.SetReadCallback(std::bind(&Connection::HandleRead, this));
         _channel.SetWriteCallback(std::bind(&Connection::HandleWrite, this));
         _channel.SetEventCallback(std::bind(&Connection::HandleEvent, this));
         _channel.SetExceptCallback(std::bind(&Connection::HandleExcept, this));
+        _idle_timer.SetCallback([this]() { OnIdleTimeout(); }); // 只捕获this，std::function内部就能放下，不申请内存
     }
     ~Connection() { LOG(DEBUG, "release connection: %p", this); }
     int Fd() { return _sockfd; }
     uint64_t Id() { return _conn_id; }
+    // 连接当前所在的loop，可以在任意线程调用；打开迁移之后返回值可能马上过期，
+    // 要在连接所在的线程中执行的任务用Send/Shutdown等接口（内部经过RunInOwnerLoop），不要直接GetLoop()->RunInLoop
+    EventLoop *GetLoop() { return _loop.load(std::memory_order_acquire); }
     bool Connected() { return _statu == CONNECTED; }            // 是否处于连接状态
+    bool Draining() { return _draining; }                       // 服务器是否正在退出，上层协议可以据此不再保持长连接
     void SetContext(const Any &context) { _context = context; } // 设置上下文
     Any *GetContext() { return &_context; }                     // 获取上下文
 
@@ -1303,41 +3512,140 @@ public: // 提供给用户的接口
     void SetClosedCallback(const ClosedCallback &cb) { _closed_callback = cb; }
     void SetServerClosedCallback(const ClosedCallback &cb) { _server_closed_callback = cb; }
     void SetAnyEventCallback(const AnyEventCallback &cb) { _anyEvent_callback = cb; }
+    // 背压控制，需要在连接建立之前设置
+    void SetHighWaterMarkCallback(uint64_t bytes, const HighWaterMarkCallback &cb)
+    {
+        _high_water_mark = bytes;
+        _high_water_callback = cb;
+    }
+    void SetLowWaterMarkCallback(uint64_t bytes, const LowWaterMarkCallback &cb)
+    {
+        _low_water_mark = bytes;
+        _low_water_callback = cb;
+    }
+    void SetWriteCompleteCallback(const WriteCompleteCallback &cb) { _write_complete_callback = cb; }
+    void SetPauseReadOnHighWater(bool on) { _pause_read_on_high_water = on; } // 超过高水位时自动暂停读
+    uint64_t PendingOutputSize() { return _out_buffer.ReadableSize(); }      // 输出缓冲区中待发送的数据大小
+    // 使用边缘触发监控套接字，需要在Established之前设置
+    void SetEdgeTriggered(bool on)
+    {
+        _edge_triggered = on;
+        _channel.SetEdgeTriggered(on);
+    }
+    void SetBusyPoll(uint32_t usec) { _socket.BusyPoll(usec); } // 设置套接字的SO_BUSY_POLL
+    // Poller支持的时候由Poller直接接收数据（io_uring多次触发的recv），Established之前调用；这样的连接不能迁移
+    void SetRecvCompletion(bool on) { _recv_completion = on; }
     void Established() // 连接建立后，设置和相关启动的函数
     {
-        _loop->RunInLoop(std::bind(&Connection::EstablishedInLoop, this));
+        RunInOwnerLoop(std::bind(&Connection::EstablishedInLoop, this));
     }
     void Send(const char *data, size_t len) // 发送数据，将要发送的数据拷贝到输出缓冲区，启动写事件监控
     {
-        // 这里的发送操作可能不会立刻被执行，只是把发送操作压入任务池，有可能在执行的时候，data指向的空间已经被释放了，所以这里需要构造一个临时对象来保存
-        Buffer buf;
-        buf.WriteAndPush(data, len);
-        _loop->RunInLoop(std::bind(&Connection::SendInLoop, this, std::move(buf)));
+        if (GetLoop()->IsInLoop())
+            return SendInLoop(data, len);
+        // 这里的发送操作可能不会立刻被执行，只是把发送操作压入任务池，有可能在执行的时候，data指向的空间已经被释放了，所以这里需要拷贝一份数据
+        // 数据比较少的时候直接拷贝到任务的闭包中，随任务节点复用，不需要申请内存
+        if (len <= InlineSendSize)
+            return QueueInOwnerLoop(InlineSendTask(this, data, len));
+        Send(std::string(data, len));
+    }
+    // 接管字符串/Buffer的所有权发送：在EventLoop线程中不拷贝数据，跨线程的时候数据随任务移动过去，也不拷贝
+    void Send(std::string &&data)
+    {
+        if (GetLoop()->IsInLoop())
+            return SendStringInLoop(data);
+        QueueInOwnerLoop(std::bind(&Connection::SendStringInLoop, this, std::move(data)));
+    }
+    void Send(Buffer &&buf)
+    {
+        if (GetLoop()->IsInLoop())
+            return SendBufferInLoop(buf);
+        QueueInOwnerLoop(std::bind(&Connection::SendBufferInLoop, this, std::move(buf)));
+    }
+    // 发送共享的只读数据，比如广播给多个连接的同一份消息，只增加引用计数
+    void Send(const std::shared_ptr<const std::string> &data)
+    {
+        RunInOwnerLoop(std::bind(&Connection::SendSharedInLoop, this, data));
+    }
+    // 聚集发送多个数据段，各个数据段按顺序发送，不会被拼接到一起
+    void SendV(const struct iovec *iov, int iovcnt)
+    {
+        if (GetLoop()->IsInLoop())
+            return SendVInLoop(iov, iovcnt);
+        // 不在EventLoop线程中，需要先拷贝一份数据，防止执行的时候数据已经被释放了
+        std::vector<std::string> segments;
+        segments.reserve(iovcnt);
+        for (int i = 0; i < iovcnt; ++i)
+            segments.push_back(std::string(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len));
+        QueueInOwnerLoop(std::bind(&Connection::SendSegmentsInLoop, this, std::move(segments)));
+    }
+    // 发送文件中[offset, offset+len)范围的内容，使用sendfile发送，fd的所有权交给连接，发送完成后自动关闭
+    void SendFile(int fd, uint64_t offset, uint64_t len)
+    {
+        RunInOwnerLoop(std::bind(&Connection::SendFileInLoop, this, fd, offset, len));
     }
     void Shutdown() // 关闭连接，实际上并不直接关闭，需要判断是否有数据待处理
     {
-        _loop->RunInLoop(std::bind(&Connection::ShutdownInLoop, this));
+        RunInOwnerLoop(std::bind(&Connection::ShutdownInLoop, this));
+    }
+    // 服务器退出时调用：继续读取和处理已经到达的数据，输入输出缓冲区都处理完之后关闭连接
+    void Drain()
+    {
+        RunInOwnerLoop(std::bind(&Connection::DrainInLoop, this));
     }
     /* release操作不应该在事件处理的时候操作，而是压入任务池，等待本次的所有事件处理完毕，处理任务池的任务的时候再执行 */
     void Release()
     {
-        _loop->QueueInLoop(std::bind(&Connection::ReleaseInLoop, this));
+        QueueInOwnerLoop(std::bind(&Connection::ReleaseInLoop, this));
     }
     void EnableInactiveRelease(int sec) // 启动非活跃连接销毁
     {
-        _loop->RunInLoop(std::bind(&Connection::EnableInactiveReleaseInLoop, this, sec));
+        RunInOwnerLoop(std::bind(&Connection::EnableInactiveReleaseInLoop, this, sec));
     }
     void DisableInactiveRelease() // 关闭非活跃连接销毁
     {
-        _loop->RunInLoop(std::bind(&Connection::DisableInactiveReleaseInLoop, this));
+        RunInOwnerLoop(std::bind(&Connection::DisableInactiveReleaseInLoop, this));
+    }
+    /* 把空闲的连接迁移到loop to中处理，只能在连接当前所在的loop线程中调用
+       空闲是指：处于连接状态，输入输出缓冲区都是空的，没有压入任务池还没执行的任务，没有超过高水位，服务器不在退出
+       不空闲的时候不迁移，返回false；由Poller直接接收数据的连接也不迁移，已经收到的数据在原来loop的完成队列中
+       只有经过QueueInOwnerLoop/RunInOwnerLoop压入的任务计入_queued，迁移会等它们执行完；
+       其他线程用GetLoop()->RunInLoop/QueueInLoop直接压入的任务不被跟踪，迁移之后仍然在原来的loop中执行，
+       和新loop中的处理并发访问连接，所以打开迁移之后不能这样使用 */
+    bool Migrate(EventLoop *to)
+    {
+        EventLoop *from = GetLoop();
+        from->AssertInLoop();
+        if (to == from || _statu != CONNECTED || _draining || _over_high_water || _channel.GetCompletion() != COMPLETION_NONE)
+            return false;
+        if (_in_buffer.ReadableSize() > 0 || _out_buffer.Empty() == false || _channel.Writeable())
+            return false;
+        uint32_t expected = 0;
+        if (_queued.compare_exchange_strong(expected, MigratingFlag, std::memory_order_acq_rel) == false)
+            return false;
+        // 1. 从原来的loop中移除事件监控和定时任务，空的输入缓冲区把内存块还给原来的池，到新的loop中再租用
+        _channel.Remove();
+        _in_buffer.Release();
+        if (_idle_timer.Linked())
+            from->TimerStop(&_idle_timer);
+        from->ConnectionRemoved();
+        UnlinkFromLoop();
+        to->ConnectionAdded(); // 计数马上转到新的loop，连接列表只能在新loop的线程中修改，在AdoptInLoop中加入
+        // 2. 换到新的loop，先压入重新添加监控的任务，再允许其他线程入队，保证它是新loop中这个连接的第一个任务
+        _channel.SetLoop(to);
+        _loop.store(to, std::memory_order_release);
+        _queued.fetch_add(1, std::memory_order_relaxed);
+        to->QueueInLoop(QueuedTask<TaskFunc>(this, std::bind(&Connection::AdoptInLoop, shared_from_this())));
+        _queued.fetch_and(~MigratingFlag, std::memory_order_release);
+        return true;
     }
     // 切换协议
     // 这个接口一定要在EventLoop线程中执行，否则可能出现新收到的数据还在使用原协议处理
     void Upgrade(const Any &context, const ConnectedCallback &conn, const MessageCallback &msg,
                  const ClosedCallback &closed, const AnyEventCallback &event)
     {
-        _loop->AssertInLoop();
-        _loop->RunInLoop(std::bind(&Connection::UpgradeInLoop, this, context, conn, msg, closed, event));
+        GetLoop()->AssertInLoop();
+        RunInOwnerLoop(std::bind(&Connection::UpgradeInLoop, this, context, conn, msg, closed, event));
     }
 };
 
@@ -1356,6 +3664,8 @@ private:
 private:
     void HandleRead() // 处理新连接到来的操作
     {
+        if (_channel.GetCompletion() == COMPLETION_ACCEPT)
+            return HandleAcceptCompletion();
         // 1. 获取新连接
         int connfd = _socket.Accept();
         if (connfd < 0)
@@ -1364,22 +3674,80 @@ private:
         if (_new_connection_callback)
             _new_connection_callback(connfd);
     }
-    int CreateServer(uint16_t port)
+    void HandleAcceptCompletion() // Poller已经接收了新连接
+    {
+        for (const Channel::Completion &c : _channel.Completions())
+        {
+            if (c._res < 0)
+            {
+                LOG(ERROR, "accept socket error, code: %d, reson: %s", -c._res, strerror(-c._res));
+                continue;
+            }
+            if (_new_connection_callback)
+                _new_connection_callback(c._res);
+            else
+                close(c._res);
+        }
+    }
+    int CreateServer(uint16_t port, bool reuse_port)
     {
-        bool ret = _socket.CreateServer(port);
+        // 监听套接字设置为非阻塞：多个线程监控同一个端口时，被唤醒的线程不一定能取到连接
+        bool ret = _socket.CreateServer(port, "0.0.0.0", true, reuse_port);
         assert(ret == true);
         return _socket.Fd();
     }
+    void CloseInLoop(bool accept_pending)
+    {
+        if (_socket.Fd() < 0)
+            return;
+        if (accept_pending)
+        {
+            int connfd;
+            while ((connfd = _socket.Accept()) >= 0)
+            {
+                if (_new_connection_callback)
+                    _new_connection_callback(connfd);
+            }
+        }
+        _channel.Remove();
+        _socket.Close();
+    }
 
 public:
-    Acceptor(EventLoop *loop, int port)
-        : _socket(CreateServer(port)), _loop(loop), _channel(_socket.Fd(), loop)
+    // reuse_port为true时监听套接字设置SO_REUSEPORT，同一个端口可以再创建多个Acceptor，由内核在它们之间分配连接
+    Acceptor(EventLoop *loop, int port, bool reuse_port = false)
+        : _socket(CreateServer(port, reuse_port)), _loop(loop), _channel(_socket.Fd(), loop)
     {
         _channel.SetReadCallback(std::bind(&Acceptor::HandleRead, this)); // bind新连接到来时的操作
     }
+    // 与shared共享同一个监听套接字（dup出来的描述符），在另一个EventLoop中监控
+    Acceptor(EventLoop *loop, Acceptor &shared)
+        : _socket(dup(shared._socket.Fd())), _loop(loop), _channel(_socket.Fd(), loop)
+    {
+        assert(_socket.Fd() >= 0);
+        _channel.SetReadCallback(std::bind(&Acceptor::HandleRead, this));
+    }
     void SetNewConnectionCallback(const AcceptCallback &cb) { _new_connection_callback = cb; } // 设置新连接到来之后的回调函数
+    // 多个EventLoop共享同一个监听套接字时使用EPOLLEXCLUSIVE，一个连接只唤醒一个线程，需要在Listen之前设置
+    void SetExclusive() { _channel.SetExclusive(); }
+
+    // 启动listen套接字的读监控，只能在EventLoop线程内调用；Poller支持的话由Poller直接接收新连接
+    void Listen()
+    {
+        _channel.SetCompletion(COMPLETION_ACCEPT);
+        _channel.EnableRead();
+    }
+    // 停止接收新连接，关闭监听套接字，可以在任意线程调用
+    // accept_pending为true时先接收已经完成握手还在队列中的连接（SO_REUSEPORT的监听套接字关闭时，内核会重置它队列中的连接）
+    void Close(bool accept_pending = false) { _loop->RunInLoop(std::bind(&Acceptor::CloseInLoop, this, accept_pending)); }
+};
 
-    void Listen() { _channel.EnableRead(); } // 启动listen套接字的读监控
+// 新连接由谁接收
+enum AcceptMode
+{
+    ACCEPT_SINGLE,    // 主线程的一个Acceptor接收所有连接，再轮流分给从属线程
+    ACCEPT_REUSEPORT, // 每个从属线程一个SO_REUSEPORT的监听套接字，由内核把连接分给各个线程，连接不需要跨线程转交
+    ACCEPT_EXCLUSIVE  // 所有从属线程用EPOLLEXCLUSIVE监控同一个监听套接字，哪个线程被唤醒连接就属于哪个线程
 };
 
 /**
@@ -1392,14 +3760,19 @@ class TcpServer
     using MessageCallback = std::function<void(const PtrConnection &, Buffer *)>;
     using ClosedCallback = std::function<void(const PtrConnection &)>;
     using AnyEventCallback = std::function<void(const PtrConnection &)>;
+    using HighWaterMarkCallback = std::function<void(const PtrConnection &, uint64_t)>;
+    using LowWaterMarkCallback = std::function<void(const PtrConnection &)>;
+    using WriteCompleteCallback = std::function<void(const PtrConnection &)>;
 private:
     int _port; // 监听端口
     int _timeout; // 多长时间没有连接认为是非活跃连接
     bool _enable_inactive_release; // 是否启动非活跃连接销毁
-    uint64_t _conn_id; // 自增的连接唯一id
+    std::atomic<uint64_t> _conn_id; // 自增的连接唯一id，多个线程接收连接时一起使用
     Acceptor _acceptor; // 监听套接字的管理对象
     EventLoop _base_loop; // 主线程的eventloop对象，处理监听事件
     LoopThreadPool _threadpool; // 从属线程池
+    AcceptMode _accept_mode; // 新连接由谁接收
+    std::vector<std::unique_ptr<Acceptor>> _loop_acceptors; // 从属线程各自的Acceptor，ACCEPT_SINGLE时为空
     std::unordered_map<uint64_t, PtrConnection> _conns; // 所有连接对象的shared_ptr管理
 
     // 回调函数
@@ -1408,24 +3781,101 @@ private:
     ClosedCallback _closed_callback;
     AnyEventCallback _anyEvent_callback;
 
+    // 输出缓冲区的背压控制
+    uint64_t _high_water_mark;
+    uint64_t _low_water_mark;
+    bool _pause_read_on_high_water;
+    HighWaterMarkCallback _high_water_callback;
+    LowWaterMarkCallback _low_water_callback;
+    WriteCompleteCallback _write_complete_callback;
+    bool _edge_triggered; // 连接是否使用边缘触发
+    uint32_t _socket_busy_poll_us; // 新连接的SO_BUSY_POLL，0表示不设置
+    int _accept_cpu; // 主线程（接收连接的loop）绑定的cpu，小于0表示不绑定
+    bool _numa_local; // 线程的内存优先放在本地NUMA节点
+    LoopThreadPool::Placement _accept_placement; // 主线程所在的cpu和NUMA节点
+
+    // 优雅退出
+    bool _stopping; // 已经开始退出
+    uint64_t _drain_total; // 开始退出时的连接数
+    uint64_t _drain_forced; // 超过期限被强制关闭的连接数
+    TimerTask _stop_timer; // 退出期限的定时任务
+
+    // 连接迁移：定期比较各个从属线程的连接数，把空闲连接从最重的loop迁移到最轻的loop
+    uint32_t _rebalance_interval; // 检查间隔（毫秒），0表示不迁移
+    int64_t _rebalance_threshold; // 最重和最轻的loop连接数相差超过这个值才迁移
+    uint32_t _rebalance_batch; // 每次最多迁移的连接数
+    TimerTask _rebalance_timer;
+    std::atomic<uint64_t> _rebalance_rounds; // 触发迁移的次数
+    std::atomic<uint64_t> _migrated; // 迁移成功的连接数
+    std::atomic<uint64_t> _migrate_skipped; // 尝试迁移但是连接不空闲的次数
+
 private:
-    void NewConnection(int fd)
+    void NewConnection(int fd) // 主线程接收的连接轮流分给从属线程
+    {
+        NewConnectionOnLoop(_threadpool.GetNextLoop(fd), fd);
+    }
+    // 创建连接并交给loop处理，在主线程或者接收这个连接的从属线程中调用
+    void NewConnectionOnLoop(EventLoop *loop, int fd)
     {
-        _conn_id++;
-        PtrConnection newconn(new Connection(_conn_id, fd, _threadpool.GetNextLoop()));
+        uint64_t id = ++_conn_id;
+        // 选中loop的时候就计入它的连接数，连续接收的一批连接按最新的计数选择，不会都落在同一个loop上；释放时在连接所在的loop中减去
+        loop->ConnectionAdded();
+        PtrConnection newconn(new Connection(id, fd, loop));
 
         newconn->SetMessageCallback(_message_callback);
         newconn->SetClosedCallback(_closed_callback);
         newconn->SetConnectedCallback(_connected_callback);
         newconn->SetAnyEventCallback(_anyEvent_callback);
         newconn->SetServerClosedCallback(std::bind(&TcpServer::RemoveConnection, this, std::placeholders::_1));
+        newconn->SetHighWaterMarkCallback(_high_water_mark, _high_water_callback);
+        newconn->SetLowWaterMarkCallback(_low_water_mark, _low_water_callback);
+        newconn->SetWriteCompleteCallback(_write_complete_callback);
+        newconn->SetPauseReadOnHighWater(_pause_read_on_high_water);
+        newconn->SetEdgeTriggered(_edge_triggered);
+        newconn->SetRecvCompletion(_rebalance_interval == 0); // 由Poller接收数据的连接不能迁移
+        if (_socket_busy_poll_us)
+            newconn->SetBusyPoll(_socket_busy_poll_us);
 
         if(_enable_inactive_release)
             newconn->EnableInactiveRelease(_timeout); // 非活跃连接的超时释放操作
+        // _conns只在主线程中访问，先压入插入任务，保证它在这个连接的RemoveConnection之前执行
+        _base_loop.RunInLoop(std::bind(&TcpServer::AddConnectionInLoop, this, newconn));
         newconn->Established(); // 就绪初始化
-
-        _conns.insert(std::make_pair(_conn_id, newconn));
-        LOG(DEBUG, "新连接：%d", _conn_id);
+        LOG(DEBUG, "新连接：%lu", id);
+    }
+    void AddConnectionInLoop(const PtrConnection &conn)
+    {
+        if (_stopping && !_stop_timer.Linked())
+            return conn->Release(); // 退出已经结束，从属线程关闭监听套接字之前接收的连接直接关闭
+        _conns.insert(std::make_pair(conn->Id(), conn));
+        if (_stopping)
+        {
+            _drain_total++; // 从属线程关闭监听套接字之前接收的连接，和其它连接一样处理完再关闭
+            conn->Drain();
+        }
+    }
+    // 在每个从属线程中创建Acceptor，之后主线程不再接收连接
+    void CreateLoopAcceptors()
+    {
+        const std::vector<EventLoop *> &loops = _threadpool.GetLoops();
+        if (_accept_mode == ACCEPT_SINGLE || loops.empty() || !_loop_acceptors.empty())
+            return;
+        for (EventLoop *loop : loops)
+        {
+            Acceptor *acceptor;
+            if (_accept_mode == ACCEPT_REUSEPORT)
+                acceptor = new Acceptor(loop, _port, true);
+            else
+            {
+                acceptor = new Acceptor(loop, _acceptor);
+                acceptor->SetExclusive();
+            }
+            acceptor->SetNewConnectionCallback(std::bind(&TcpServer::NewConnectionOnLoop, this, loop, std::placeholders::_1));
+            _loop_acceptors.emplace_back(acceptor);
+            loop->RunInLoop(std::bind(&Acceptor::Listen, acceptor));
+        }
+        // REUSEPORT：主线程的监听套接字关闭后，内核不会再把连接分给它；EXCLUSIVE：从属线程持有dup出来的描述符，监听套接字不会真正关闭
+        _acceptor.Close(_accept_mode == ACCEPT_REUSEPORT);
     }
     void RemoveConnectionInLoop(const PtrConnection &conn)
     {
@@ -1433,33 +3883,209 @@ private:
         auto it = _conns.find(id);
         if(it != _conns.end())
             _conns.erase(id);
+        if (_stopping && _conns.empty() && _stop_timer.Linked())
+            FinishStop(); // 期限之前所有连接都已经关闭（强制关闭之后已经结束了，定时任务不在时间轮中）
+    }
+    void StopInLoop(uint32_t deadline)
+    {
+        if (_stopping)
+            return;
+        _stopping = true;
+        // 1. 先停止接收新连接
+        _acceptor.Close();
+        for (auto &acceptor : _loop_acceptors)
+            acceptor->Close();
+        // 2. 通知所有连接处理完已经收到的请求、发送完输出队列之后关闭
+        _drain_total = _conns.size();
+        if (_conns.empty())
+            return FinishStop();
+        for (auto &it : _conns)
+            it.second->Drain();
+        // 3. 超过期限还没有关闭的连接强制关闭
+        _stop_timer.SetCallback(std::bind(&TcpServer::ForceStop, this));
+        _base_loop.TimerStart(&_stop_timer, deadline);
     }
-    void RemoveConnection(const PtrConnection &conn)
+    void ForceStop()
+    {
+        _drain_forced = _conns.size();
+        for (auto &it : _conns)
+            it.second->Release(); // 压入连接所在loop的任务池，在这些loop退出前的最后一轮中执行
+        FinishStop();
+    }
+    void FinishStop()
+    {
+        _base_loop.TimerStop(&_stop_timer);
+        _base_loop.TimerStop(&_rebalance_timer);
+        // 正常退出的统计通过GetStopStats获取，只有超过期限强制关闭了连接才需要报告
+        if (_drain_forced > 0)
+            LOG(ERROR, "server stopped, %lu connections force-closed after the deadline", _drain_forced);
+        _base_loop.Quit();
+    }
+    void RemoveConnection(const PtrConnection &conn) // 在连接所在的从属线程中调用，_conns只在主线程中访问
     {
         _base_loop.RunInLoop(std::bind(&TcpServer::RemoveConnectionInLoop, this, conn));
-        _conns.erase(conn->Id());
+    }
+    void Rebalance() // 在主线程中定期执行
+    {
+        if (_stopping)
+            return;
+        const std::vector<EventLoop *> &loops = _threadpool.GetLoops();
+        EventLoop *heavy = loops[0], *light = loops[0];
+        for (EventLoop *loop : loops)
+        {
+            if (loop->ActiveConnections() > heavy->ActiveConnections())
+                heavy = loop;
+            if (loop->ActiveConnections() < light->ActiveConnections())
+                light = loop;
+        }
+        int64_t diff = heavy->ActiveConnections() - light->ActiveConnections();
+        if (diff > _rebalance_threshold)
+        {
+            // 连接是否空闲只能在它所在的loop中判断，主线程只选出两个loop，由heavy在自己的连接列表中挑出空闲的迁移
+            uint32_t count = std::min<int64_t>(diff / 2, _rebalance_batch);
+            heavy->QueueInLoop(std::bind(&TcpServer::MigrateInLoop, this, heavy, light, count));
+            _rebalance_rounds.fetch_add(1, std::memory_order_relaxed);
+        }
+        _base_loop.TimerStart(&_rebalance_timer, _rebalance_interval);
+    }
+    void MigrateInLoop(EventLoop *from, EventLoop *to, uint32_t count) // 在连接较多的loop中执行，只遍历这个loop自己的连接
+    {
+        std::vector<Connection *> &conns = from->Connections();
+        // 从后往前遍历：迁移走的连接由最后一个连接填补，最后一个已经检查过了
+        for (size_t i = conns.size(); i > 0 && count > 0; --i)
+        {
+            Connection *conn = conns[i - 1];
+            if (conn->Migrate(to))
+            {
+                --count;
+                _migrated.fetch_add(1, std::memory_order_relaxed);
+            }
+            else
+                _migrate_skipped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    void StartRebalanceInLoop()
+    {
+        if (_rebalance_interval == 0 || _threadpool.GetLoops().size() < 2)
+            return;
+        _rebalance_timer.SetCallback(std::bind(&TcpServer::Rebalance, this));
+        _base_loop.TimerStart(&_rebalance_timer, _rebalance_interval);
     }
     void RunAfterInLoop(const TaskFunc &cb, int delay)
     {
         _base_loop.TimerAdd(_conn_id, delay, cb);
     }
 public:
-    TcpServer(uint16_t port, int thread_num = 0)
+    // thread_num是从属线程个数，默认（小于0）使用CPU核数，0表示所有连接都在主线程处理，Start之前可以用SetThreadNum修改
+    // poller选择所有loop使用的事件监控方式，io_uring不可用的时候退回epoll；
+    // io_uring在6.0以上的内核上由多次触发的accept/recv直接接收新连接和数据，不再先等可读事件
+    // accept_mode选择由主线程还是各个从属线程接收新连接，没有从属线程时总是由主线程接收
+    TcpServer(uint16_t port, int thread_num = -1, PollerType poller = POLLER_EPOLL, AcceptMode accept_mode = ACCEPT_SINGLE)
         : _port(port),_conn_id(0), _enable_inactive_release(false)
-        , _acceptor(&_base_loop, port), _threadpool(&_base_loop) 
+        , _acceptor(&_base_loop, port, accept_mode == ACCEPT_REUSEPORT), _base_loop(poller), _threadpool(&_base_loop, poller)
+        , _accept_mode(accept_mode)
+        , _high_water_mark(0), _low_water_mark(0), _pause_read_on_high_water(false), _edge_triggered(false)
+        , _socket_busy_poll_us(0), _accept_cpu(-1), _numa_local(false), _accept_placement{-1, -1}
+        , _stopping(false), _drain_total(0), _drain_forced(0)
+        , _rebalance_interval(0), _rebalance_threshold(0), _rebalance_batch(0)
+        , _rebalance_rounds(0), _migrated(0), _migrate_skipped(0)
         {
-            _threadpool.Create(); // 创从属线程池（这里是不是不能创建从属线程，由于在调用之前没有设置从属线程个数）
+            _threadpool.SetThreadNum(thread_num); // 从属线程在Start中创建，这样之后调用的SetThreadNum才能生效
             _acceptor.Listen(); // 启动监听套接字的读监控
             _acceptor.SetNewConnectionCallback(std::bind(&TcpServer::NewConnection, this, std::placeholders::_1));
         }
 
-    void SetThreadNum(int num) { _threadpool.SetThreadNum(num); }
+    void SetThreadNum(int num) { _threadpool.SetThreadNum(num); } // Start之前调用
+    // 主线程接收的连接分给从属线程的策略（ACCEPT_SINGLE），其他接收方式由接收连接的loop自己处理，不经过这里，Start之前调用
+    void SetLoadBalancer(LoadBalance type) { _threadpool.SetLoadBalancer(type); }
+    void SetLoadBalancer(LoadBalancer *balancer) { _threadpool.SetLoadBalancer(balancer); } // 自定义策略，TcpServer负责释放
+    int LoopCount() { return _threadpool.LoopCount(); } // 实际处理连接的loop个数，运行期间有效
 
     /* 设置回调函数 */
     void SetConnectedCallback(const ConnectedCallback &cb) { _connected_callback = cb; }
     void SetMessageCallback(const MessageCallback &cb) { _message_callback = cb; }
     void SetClosedCallback(const ClosedCallback &cb) { _closed_callback = cb; }
     void SetAnyEventCallback(const AnyEventCallback &cb) { _anyEvent_callback = cb; }
+    // 连接的输出缓冲区中待发送数据达到bytes时调用cb，生产者可以据此暂停发送
+    void SetHighWaterMarkCallback(uint64_t bytes, const HighWaterMarkCallback &cb)
+    {
+        _high_water_mark = bytes;
+        _high_water_callback = cb;
+    }
+    // 超过高水位之后，待发送数据降到bytes以下时调用cb，生产者可以据此恢复发送
+    void SetLowWaterMarkCallback(uint64_t bytes, const LowWaterMarkCallback &cb)
+    {
+        _low_water_mark = bytes;
+        _low_water_callback = cb;
+    }
+    // 输出缓冲区的数据全部写入套接字之后调用
+    void SetWriteCompleteCallback(const WriteCompleteCallback &cb) { _write_complete_callback = cb; }
+    // 超过高水位的时候自动暂停连接的读事件监控，降到低水位以下再恢复
+    void SetPauseReadOnHighWater(bool on) { _pause_read_on_high_water = on; }
+    // 新连接使用边缘触发（EPOLLET），读写事件都一直处理到EAGAIN，减少大量数据传输时epoll_wait的次数
+    void EnableEdgeTriggered(bool on = true) { _edge_triggered = on; }
+    // 所有loop没有事件时先忙轮询spin_us微秒再阻塞，降低延迟但会占用CPU，0表示关闭
+    // socket_us不为0时给新连接设置SO_BUSY_POLL，让内核在读取时也忙等网卡队列
+    void EnableBusyPoll(uint32_t spin_us, uint32_t socket_us = 0)
+    {
+        _base_loop.SetBusyPoll(spin_us);
+        _threadpool.SetBusyPoll(spin_us);
+        _socket_busy_poll_us = socket_us;
+    }
+    /* 线程的位置，都在Start之前调用 */
+    // 主线程（接收连接的loop）绑定到cpu上，一般给它单独留一个核
+    void SetAcceptCpu(int cpu) { _accept_cpu = cpu; }
+    // 第i个从属线程绑定到cpus[i % cpus.size()]上
+    void SetLoopCpus(const std::vector<int> &cpus) { _threadpool.SetCpuAffinity(cpus); }
+    // 每个线程的内存优先放在所在的NUMA节点上（从属线程先绑核再创建loop，loop的内存本来就在本地节点上）
+    void EnableNumaLocal(bool on = true)
+    {
+        _numa_local = on;
+        _threadpool.SetNumaLocal(on);
+    }
+    // 每个loop所在的cpu和NUMA节点，顺序和GetLoops一致，Start之后有效（绑核失败会打印错误日志，绑定的cpu和这里的不一致）
+    std::vector<LoopThreadPool::Placement> GetPlacement()
+    {
+        std::vector<LoopThreadPool::Placement> placement(1, _accept_placement);
+        std::vector<LoopThreadPool::Placement> others = _threadpool.GetPlacement();
+        placement.insert(placement.end(), others.begin(), others.end());
+        return placement;
+    }
+    // 主线程loop和所有从属线程loop，可以用来读取每个loop的统计信息
+    std::vector<EventLoop *> GetLoops()
+    {
+        std::vector<EventLoop *> loops(1, &_base_loop);
+        const std::vector<EventLoop *> &others = _threadpool.GetLoops();
+        loops.insert(loops.end(), others.begin(), others.end());
+        return loops;
+    }
+
+    /* 连接迁移，Start之前调用：每interval毫秒比较一次各个从属线程的连接数，最多和最少的相差超过threshold时，
+       从最多的loop中挑出最多batch个空闲连接（缓冲区为空、没有待执行的任务）迁移到最少的loop中，
+       长连接的负载倾斜可以慢慢纠正过来
+       打开之后，在连接所在线程之外要通过Connection的接口操作连接，自己用conn->GetLoop()->RunInLoop压入的任务不被迁移跟踪，
+       可能在连接迁走之后还在原来的loop中执行
+       io_uring的多次触发recv收到的数据在原来loop的完成队列中，打开迁移之后新连接不使用它，还是等可读事件再读 */
+    void EnableRebalance(uint32_t interval, int64_t threshold = 2, uint32_t batch = 16)
+    {
+        _rebalance_interval = interval;
+        _rebalance_threshold = std::max<int64_t>(threshold, 1);
+        _rebalance_batch = batch;
+    }
+    struct MigrationStats
+    {
+        uint64_t rounds;   // 触发迁移的次数
+        uint64_t migrated; // 迁移成功的连接数
+        uint64_t skipped;  // 选中但是不空闲没有迁移的次数
+    };
+    MigrationStats GetMigrationStats() // 可以在任意线程调用
+    {
+        MigrationStats stats;
+        stats.rounds = _rebalance_rounds.load(std::memory_order_relaxed);
+        stats.migrated = _migrated.load(std::memory_order_relaxed);
+        stats.skipped = _migrate_skipped.load(std::memory_order_relaxed);
+        return stats;
+    }
 
     void EnableInactiveRelease(int sec) // 启动非活跃连接销毁
     {
@@ -1470,16 +4096,52 @@ public:
     {
         _base_loop.RunInLoop(std::bind(&TcpServer::RunAfterInLoop, this, cb, delay));
     }
+    // 启动服务器，调用Stop之后所有连接关闭、从属线程退出之后返回
     void Start()
     {
+        // 调用Start的线程就是主线程，在这里绑核
+        if (_accept_cpu >= 0)
+            CpuAffinity::PinCurrentThread(_accept_cpu);
+        CpuAffinity::CurrentPlacement(&_accept_placement.cpu, &_accept_placement.node);
+        if (_numa_local)
+            CpuAffinity::PreferLocalMemory(_accept_placement.node);
+        _threadpool.Create(); // 创建从属线程池
+        CreateLoopAcceptors();
+        _base_loop.RunInLoop(std::bind(&TcpServer::StartRebalanceInLoop, this));
         _base_loop.Start();
+        _threadpool.Stop();
+    }
+    // 优雅退出，可以在任意线程调用：先关闭监听套接字，再等待所有连接处理完已经收到的请求并发送完数据后关闭，
+    // 超过deadline毫秒还没有关闭的连接强制关闭，最后退出所有EventLoop，Start返回
+    void Stop(uint32_t deadline)
+    {
+        _base_loop.RunInLoop(std::bind(&TcpServer::StopInLoop, this, deadline));
+    }
+    struct StopStats
+    {
+        uint64_t drained; // 在期限内处理完并关闭的连接数
+        uint64_t forced;  // 超过期限被强制关闭的连接数
+    };
+    StopStats GetStopStats() // Start返回之后调用
+    {
+        StopStats stats;
+        stats.drained = _drain_total - _drain_forced;
+        stats.forced = _drain_forced;
+        return stats;
     }
-    
+
 };
 
 // 这里是一些必须在所有类之后实现的函数，因为这些函数使用到了在后续定义的类中的成员函数，在类内实现将会出现xx方法味定义的情况
 void Channel::Remove() { _loop->RemoveEvent(this); } // 移除监控
 void Channel::Update() { _loop->UpdateEvent(this); } // 添加、更新监控
+bool Channel::SetCompletion(CompletionMode mode)
+{
+    if (mode != COMPLETION_NONE && _loop->SupportCompletion(mode) == false)
+        return false;
+    _completion = mode;
+    return true;
+}
 
 void TimerWheel::TimerAdd(uint64_t id, uint32_t delay, const TaskFunc &cb)
 {
@@ -0,0 +1,31 @@
+// 测试程序共用的全局operator new/delete替换：统计申请内存的次数
+/**
+ * 所有形式的new都走到operator new(size_t)中统计，所有形式的delete（普通、数组、带大小的）都用free释放，
+ * 保证申请和释放是配对的；这些函数不能内联，否则编译器在调用处看到new出来的指针被free，会报-Wmismatched-new-delete
+ * 需要按大小统计的测试（比如只统计负载大小的申请）可以设置g_alloc_hook，每次申请都会用申请的大小调用它
+ * 只能被一个测试程序的一个源文件包含
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> g_alloc_count(0);      // 申请内存的次数
+static void (*g_alloc_hook)(size_t size) = nullptr; // 每次申请时调用，nullptr表示不调用
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    if (g_alloc_hook != nullptr)
+        g_alloc_hook(size);
+    void *p = malloc(size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+__attribute__((noinline)) void *operator new[](size_t size) { return ::operator new(size); }
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept { free(p); }
@@ -0,0 +1,112 @@
+// 新连接接收方式的吞吐测试：每秒能建立多少个连接，以及连接在各个loop之间的分布
+/**
+ * 同一个进程里面依次启动三种接收方式的服务器：
+ *  single    主线程一个Acceptor接收所有连接，再轮流分给从属线程
+ *  reuseport 每个从属线程一个SO_REUSEPORT监听套接字
+ *  exclusive 所有从属线程用EPOLLEXCLUSIVE监控同一个监听套接字
+ * 服务器在连接建立后发送1个字节并关闭，多个客户端线程不停地 连接->读到1个字节->读到EOF->关闭（服务器先关闭，TIME_WAIT留在服务器一侧）
+ * 统计固定时间内完成的连接数，以及每个loop处理的连接数
+ * 用法：./bench_accept [从属线程数] [客户端线程数] [每种方式的测试时间(毫秒)]
+ */
+
+#include "../source/server.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+
+static std::atomic<TcpServer *> g_server(nullptr);
+static std::vector<EventLoop *> g_loops;
+static uint64_t g_loop_conns[64];
+static std::atomic<bool> g_running(false);
+
+void OnConnected(const PtrConnection &conn)
+{
+    for (size_t i = 0; i < g_loops.size(); ++i)
+    {
+        if (g_loops[i]->IsInLoop())
+        {
+            g_loop_conns[i]++; // 只有这个loop的线程会修改
+            break;
+        }
+    }
+    conn->Send("x", 1);
+    conn->Shutdown();
+}
+
+// TcpServer在运行它的线程中创建，这样主线程loop的线程id就是这个线程
+void RunServer(uint16_t port, int threads, AcceptMode mode)
+{
+    TcpServer *server = new TcpServer(port, threads, POLLER_EPOLL, mode);
+    server->SetConnectedCallback(OnConnected);
+    g_server = server;
+    server->Start();
+}
+
+void Client(uint16_t port, std::atomic<uint64_t> *done)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    uint64_t count = 0;
+    while (g_running)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        char c;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && read(fd, &c, 1) == 1 && read(fd, &c, 1) == 0)
+            ++count;
+        close(fd);
+    }
+    *done += count;
+}
+
+void Measure(const char *name, uint16_t port, AcceptMode mode, int threads, int clients, int ms)
+{
+    memset(g_loop_conns, 0, sizeof(g_loop_conns));
+    g_server = nullptr;
+    std::thread server(RunServer, port, threads, mode);
+    while (g_server == nullptr)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    // 主线程loop开始运行时从属线程已经创建完成，在主线程loop中读取所有loop
+    std::promise<std::vector<EventLoop *>> loops;
+    TcpServer *srv = g_server;
+    srv->GetLoops()[0]->RunInLoop([&]() { loops.set_value(srv->GetLoops()); });
+    g_loops = loops.get_future().get();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    std::atomic<uint64_t> done(0);
+    g_running = true;
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < clients; ++i)
+        workers.emplace_back(Client, port, &done);
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    g_running = false;
+    for (auto &t : workers)
+        t.join();
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    g_server.load()->Stop(1000);
+    server.join();
+    printf("%-10s %10.0f conns/s   per loop:", name, done / sec);
+    for (size_t i = 0; i < g_loops.size(); ++i)
+        printf(" %lu", g_loop_conns[i]);
+    printf("\n");
+    delete g_server.load();
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    int clients = argc > 2 ? atoi(argv[2]) : 4;
+    int ms = argc > 3 ? atoi(argv[3]) : 2000;
+    if (threads < 1 || threads > 63)
+        threads = 4;
+    printf("%d loop threads, %d client threads, %d ms each (per loop: main loop first)\n", threads, clients, ms);
+    Measure("single", 9201, ACCEPT_SINGLE, threads, clients, ms);
+    Measure("reuseport", 9202, ACCEPT_REUSEPORT, threads, clients, ms);
+    Measure("exclusive", 9203, ACCEPT_EXCLUSIVE, threads, clients, ms);
+    return 0;
+}
@@ -0,0 +1,83 @@
+// 忙轮询对请求延迟的影响：乒乓测试的p50/p99延迟，以及loop的轮询统计
+/**
+ * 同一个进程里面分别启动一个普通的和一个开启忙轮询的回显服务器
+ * 客户端每次发送一个小消息，收到回显之后再发下一个，记录每一次往返的时间
+ * 服务器在两次请求之间没有事件，普通模式下每个请求都要经过一次阻塞和唤醒，忙轮询模式下在预算内一直轮询
+ * 用法：./bench_busy_poll [往返次数] [忙轮询预算(微秒)] [SO_BUSY_POLL(微秒)]
+ */
+
+#include "../source/server.hpp"
+
+#include <atomic>
+#include <chrono>
+
+static std::atomic<TcpServer *> g_servers[2];
+
+void OnMessage(const PtrConnection &conn, Buffer *buf)
+{
+    conn->Send(buf->ReadPosition(), buf->ReadableSize());
+    buf->MoveReadOffset(buf->ReadableSize());
+}
+
+// TcpServer在运行它的线程中创建，这样loop的线程id就是这个线程
+void RunServer(int index, uint16_t port, uint32_t spin_us, uint32_t socket_us)
+{
+    TcpServer *server = new TcpServer(port);
+    server->EnableBusyPoll(spin_us, socket_us);
+    server->SetMessageCallback(OnMessage);
+    g_servers[index] = server;
+    server->Start();
+}
+
+void Measure(const char *name, int index, uint16_t port, int rounds)
+{
+    while (g_servers[index].load() == nullptr)
+        std::this_thread::yield();
+    Socket sock;
+    assert(sock.CreateClient(port, "127.0.0.1"));
+    int opt = 1;
+    setsockopt(sock.Fd(), IPPROTO_TCP, 1 /*TCP_NODELAY*/, &opt, sizeof(opt));
+    char msg[64] = {0}, buf[64];
+    std::vector<double> rtts(rounds);
+    for (int i = -1000; i < rounds; ++i) // 前1000次预热
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (write(sock.Fd(), msg, sizeof(msg)) != sizeof(msg))
+            abort();
+        size_t got = 0;
+        while (got < sizeof(buf))
+        {
+            ssize_t n = read(sock.Fd(), buf + got, sizeof(buf) - got);
+            if (n <= 0)
+                abort();
+            got += n;
+        }
+        auto end = std::chrono::steady_clock::now();
+        if (i >= 0)
+            rtts[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000.0;
+    }
+    std::sort(rtts.begin(), rtts.end());
+    printf("%-10s p50: %7.1f us  p99: %7.1f us  p99.9: %7.1f us\n", name,
+           rtts[rounds / 2], rtts[rounds * 99 / 100], rtts[rounds * 999 / 1000]);
+    for (EventLoop *loop : g_servers[index].load()->GetLoops())
+    {
+        EventLoop::PollStats stats = loop->GetPollStats();
+        printf("           polls: %lu  busy hits: %lu  busy misses: %lu  spin: %.1f ms  blocked: %.1f ms\n",
+               stats.polls, stats.busy_hits, stats.busy_misses, stats.spin_ns / 1e6, stats.block_ns / 1e6);
+    }
+    sock.Close();
+}
+
+int main(int argc, char *argv[])
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 20000;
+    uint32_t spin_us = argc > 2 ? atoi(argv[2]) : 200;
+    uint32_t socket_us = argc > 3 ? atoi(argv[3]) : 0;
+    std::thread(RunServer, 0, 9192, 0, 0).detach();
+    std::thread(RunServer, 1, 9193, spin_us, socket_us).detach();
+    printf("%d round trips, busy-poll budget %u us, SO_BUSY_POLL %u us\n", rounds, spin_us, socket_us);
+    Measure("blocking", 0, 9192, rounds);
+    Measure("busy-poll", 1, 9193, rounds);
+    fflush(stdout);
+    _exit(0);
+}
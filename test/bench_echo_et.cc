@@ -0,0 +1,96 @@
+// 水平触发和边缘触发的回显服务器吞吐量对比
+/**
+ * 同一个进程里面分别启动一个水平触发和一个边缘触发的回显服务器（收到什么就发回什么，不关闭连接）
+ * 每个客户端连接一个线程不停地发送数据，另一个线程把回显的数据读回来，统计总吞吐量
+ * 同时通过任意事件回调统计连接上的事件处理次数，也就是epoll_wait返回这个连接就绪的次数
+ * 用法：./bench_echo_et [连接数] [每个连接发送的MB数]
+ */
+
+#include "../source/server.hpp"
+
+#include <atomic>
+#include <chrono>
+
+static std::atomic<uint64_t> g_events(0);
+
+void OnMessage(const PtrConnection &conn, Buffer *buf)
+{
+    conn->Send(buf->ReadPosition(), buf->ReadableSize());
+    buf->MoveReadOffset(buf->ReadableSize());
+}
+
+void RunServer(TcpServer *server)
+{
+    server->Start();
+}
+
+void StartServer(uint16_t port, bool edge_triggered)
+{
+    TcpServer *server = new TcpServer(port);
+    server->EnableEdgeTriggered(edge_triggered);
+    server->SetMessageCallback(OnMessage);
+    server->SetAnyEventCallback([](const PtrConnection &) { g_events.fetch_add(1, std::memory_order_relaxed); });
+    std::thread(RunServer, server).detach();
+}
+
+void Writer(int fd, uint64_t bytes)
+{
+    std::string chunk(256 * 1024, 'x');
+    while (bytes > 0)
+    {
+        size_t len = std::min<uint64_t>(bytes, chunk.size());
+        ssize_t n = write(fd, chunk.data(), len);
+        if (n <= 0)
+            abort();
+        bytes -= n;
+    }
+}
+
+void Reader(int fd, uint64_t bytes)
+{
+    char buf[256 * 1024];
+    while (bytes > 0)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0)
+            abort();
+        bytes -= n;
+    }
+}
+
+void Measure(const char *name, uint16_t port, int conns, uint64_t bytes)
+{
+    std::vector<Socket> socks(conns);
+    for (auto &sock : socks)
+        assert(sock.CreateClient(port, "127.0.0.1"));
+    g_events = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (auto &sock : socks)
+    {
+        threads.push_back(std::thread(Writer, sock.Fd(), bytes));
+        threads.push_back(std::thread(Reader, sock.Fd(), bytes));
+    }
+    for (auto &t : threads)
+        t.join();
+    auto end = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+    double mb = (double)bytes * conns / (1 << 20);
+    printf("%-16s %8.1f MB/s  %8lu events  %6.1f events/MB\n", name, mb / sec, g_events.load(), g_events.load() / mb);
+    for (auto &sock : socks)
+        sock.Close();
+}
+
+int main(int argc, char *argv[])
+{
+    int conns = argc > 1 ? atoi(argv[1]) : 4;
+    uint64_t bytes = (argc > 2 ? atoi(argv[2]) : 256) * (1ULL << 20);
+    StartServer(9190, false);
+    StartServer(9191, true);
+    sleep(1);
+    printf("%d connections, %lu MB each way per connection\n", conns, bytes >> 20);
+    Measure("level-triggered", 9190, conns, bytes);
+    Measure("edge-triggered", 9191, conns, bytes);
+    fflush(stdout);
+    _exit(0);
+}
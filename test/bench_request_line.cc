@@ -0,0 +1,78 @@
+// 请求行解析的性能测试：原来每个请求构造std::regex进行匹配的方式和现在的状态机解析对比，每秒能够解析的请求数
+/**
+ * 原来的解析方式：从缓冲区中取出一行拷贝到字符串，构造正则表达式匹配，再把各个部分拷贝到请求对象中
+ * 现在的解析方式：HttpContext在缓冲区上逐字节解析，只记录各个部分的位置
+ * 请求只有请求行和一个空行，测试的就是请求行的解析
+ */
+
+#include "../source/http/http.hpp"
+
+#include <chrono>
+
+static const std::string g_line = "GET /index.html?word=C%2B%2B&page=2 HTTP/1.1\r\n";
+
+// 原来HttpContext::ParseRequestLine的实现
+bool RegexParseRequestLine(const std::string &line, HttpRequest &request)
+{
+    std::smatch matches;
+    std::regex reg("(GET|HEAD|POST|PUT|DELETE) ([^?]*)(?:\\?(.*))? (HTTP/1\\.[01])(?:\n|\r\n)?", std::regex::icase);
+    bool ret = std::regex_match(line, matches, reg);
+    if (ret == false)
+        return false;
+    request._method = matches[1];
+    std::transform(request._method.begin(), request._method.end(), request._method.begin(), ::toupper);
+    request._path = Util::UrlDecode(matches[2], false);
+    request._version = matches[4];
+    std::string query = matches[3];
+    std::vector<std::string> query_array;
+    Util::Split(query, "&", query_array);
+    for (auto &str : query_array)
+    {
+        size_t pos = str.find("=");
+        if (pos == std::string::npos)
+            return false;
+        request.SetParam(str.substr(0, pos), str.substr(pos + 1));
+    }
+    return true;
+}
+
+template <class F>
+void Measure(const char *name, int n, F parse)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i)
+    {
+        if (parse() == false)
+        {
+            printf("%s: parse failed\n", name);
+            exit(1);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1e9;
+    printf("%-16s %10.0f requests/sec  %8.0f ns/request\n", name, n / sec, sec * 1e9 / n);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 200000;
+    std::string request = g_line + "\r\n";
+    Buffer buffer;
+    HttpRequest req;
+    Measure("std::regex", n / 20, [&]() {
+        buffer.WriteStringAndPush(g_line);
+        std::string line = buffer.GetLineAndPop();
+        req.Reset();
+        return RegexParseRequestLine(line, req);
+    });
+    HttpContext context;
+    Measure("state machine", n, [&]() {
+        buffer.WriteStringAndPush(request);
+        context.RecvHttpRequest(&buffer);
+        bool ok = context.GetState() == RECV_HTTP_OVER;
+        buffer.MoveReadOffset(context.RequestSize());
+        context.Reset();
+        return ok;
+    });
+    return 0;
+}
@@ -0,0 +1,100 @@
+// Connection::Send各个重载的开销测试：每次调用拷贝了多少字节的数据，以及每次调用的耗时
+/**
+ * 通过重载operator new统计申请的内存，负载大小的内存申请次数就是负载被拷贝的次数（负载大于输出队列的合并大小，不会被合并）
+ * 内存块池的高水位设置为0，保证Buffer的拷贝也会走到operator new
+ * 分别在EventLoop线程内和其他线程中调用，对端由一个单独的线程一直读取并丢弃数据
+ */
+
+#include "../source/server.hpp"
+#include "alloc_counter.hpp"
+
+#include <atomic>
+#include <chrono>
+
+static std::atomic<uint64_t> g_copy_bytes(0);
+static size_t g_payload_size = 16384;
+
+void CountPayloadCopy(size_t size)
+{
+    if (size >= g_payload_size && size <= g_payload_size + 64)
+        g_copy_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+static const int N = 2000;
+
+void Drain(int fd)
+{
+    char buffer[65536];
+    while (read(fd, buffer, sizeof(buffer)) > 0)
+        ;
+}
+
+// 在调用线程中执行N次发送，统计拷贝的字节数和耗时
+template <class F>
+void Measure(const char *name, F send)
+{
+    uint64_t before = g_copy_bytes.load();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N; ++i)
+        send();
+    auto end = std::chrono::steady_clock::now();
+    double copied = (double)(g_copy_bytes.load() - before) / N;
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / (double)N;
+    printf("%-36s bytes copied/call: %8.0f (%.2f x payload)  ns/call: %8.0f\n", name, copied, copied / g_payload_size, ns);
+}
+
+void RunAll(const PtrConnection &conn, const std::string &payload, const std::shared_ptr<const std::string> &shared)
+{
+    Measure("Send(const char *, size_t)", [&]() { conn->Send(payload.c_str(), payload.size()); });
+    // 构造字符串/Buffer本身需要拷贝一次负载，这里先构造好，只统计Send的开销
+    std::vector<std::string> strs(N, payload);
+    int si = 0;
+    Measure("Send(std::string &&)", [&]() { conn->Send(std::move(strs[si++])); });
+    std::vector<Buffer> bufs(N);
+    for (auto &b : bufs)
+        b.WriteStringAndPush(payload);
+    int bi = 0;
+    Measure("Send(Buffer &&)", [&]() { conn->Send(std::move(bufs[bi++])); });
+    Measure("Send(shared_ptr<const std::string>)", [&]() { conn->Send(shared); });
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        g_payload_size = atoi(argv[1]);
+    g_alloc_hook = CountPayloadCopy;
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    std::thread reader(Drain, sv[1]);
+    reader.detach();
+
+    LoopThread thread;
+    EventLoop *loop = thread.GetLoop();
+    PtrConnection conn(new Connection(1, sv[0], loop));
+    conn->Established();
+
+    std::string payload(g_payload_size, 'x');
+    std::shared_ptr<const std::string> shared(new std::string(payload));
+
+    printf("payload: %lu bytes, %d calls each\n", g_payload_size, N);
+    printf("-- called from the EventLoop thread --\n");
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool done = false;
+    BufferPool::Current()->SetHighWater(0);
+    loop->RunInLoop([&]() {
+        loop->SetBufferPoolHighWater(0);
+        RunAll(conn, payload, shared);
+        std::unique_lock<std::mutex> lck(mutex);
+        done = true;
+        cond.notify_all();
+    });
+    {
+        std::unique_lock<std::mutex> lck(mutex);
+        cond.wait(lck, [&]() { return done; });
+    }
+    printf("-- called from another thread --\n");
+    RunAll(conn, payload, shared);
+    fflush(stdout);
+    _exit(0);
+}
@@ -0,0 +1,115 @@
+// EventLoop跨线程任务的内存申请测试：每个跨线程任务申请了多少次内存，以及每个任务的耗时
+/**
+ * 通过重载operator new统计申请内存的次数，先预热一轮让任务节点进入空闲链表，再统计N个任务
+ * 闭包的形状和Connection中的一致：Shutdown/Release是成员函数指针+this，Send(std::string &&)带着一个字符串，
+ * Upgrade带着一个Any和四个回调函数（Any用空的，它的拷贝不算在任务上）；Send(const char *, size_t)在真实的连接上发送64字节
+ * 作为对比，同样的闭包先包装成std::function（原来的TaskFunc）再入队
+ * 生产者比EventLoop线程快的时候队列会堆积，深度超过之前的最大值时才会新建节点，所以统计的结果可能略大于0；
+ * Send(const char *, size_t)还包括对端读得慢时输出缓冲区增长申请的内存块
+ */
+
+#include "../source/server.hpp"
+
+#include <atomic>
+#include <chrono>
+
+#include "alloc_counter.hpp"
+
+static const int N = 100000;
+static std::atomic<int> g_done(0);
+
+struct Probe
+{
+    void ShutdownInLoop() { g_done.fetch_add(1, std::memory_order_relaxed); }
+    void SendStringInLoop(const std::string &data) { g_done.fetch_add(1, std::memory_order_relaxed); }
+    typedef std::function<void(const PtrConnection &)> Callback;
+    void UpgradeInLoop(const Any &context, const Callback &conn, const Callback &msg, const Callback &closed, const Callback &event)
+    {
+        g_done.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+void Drain(int fd)
+{
+    char buffer[65536];
+    while (read(fd, buffer, sizeof(buffer)) > 0)
+        ;
+}
+
+// 等待EventLoop线程执行完所有任务
+void Wait(EventLoop *loop)
+{
+    std::atomic<bool> flag(false);
+    loop->QueueInLoop([&flag]() { flag = true; }); // 小闭包，不计入申请次数（节点复用之后为0）
+    while (!flag)
+        std::this_thread::yield();
+}
+
+// 在当前线程调用N次queue（每次压入一个任务），统计申请内存的次数和耗时
+template <class F>
+void Measure(const char *name, EventLoop *loop, F queue)
+{
+    for (int r = 0; r < 5; ++r) // 预热
+    {
+        for (int i = 0; i < N; ++i)
+            queue(i);
+        Wait(loop);
+    }
+    uint64_t before = g_alloc_count.load();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < N; ++i)
+        queue(i);
+    Wait(loop);
+    auto end = std::chrono::steady_clock::now();
+    double allocs = (double)(g_alloc_count.load() - before) / N;
+    double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / (double)N;
+    printf("%-40s allocs/task: %6.3f  ns/task: %6.0f\n", name, allocs, ns);
+}
+
+int main()
+{
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    std::thread reader(Drain, sv[1]);
+    reader.detach();
+
+    LoopThread thread;
+    EventLoop *loop = thread.GetLoop();
+    PtrConnection conn(new Connection(1, sv[0], loop));
+    conn->Established();
+    Wait(loop);
+
+    Probe probe;
+    std::vector<std::string> strs(6 * N, std::string(1024, 'x')); // 字符串本身的拷贝不统计
+    Any context; // 空的Any拷贝不申请内存，只统计任务本身
+
+    Probe::Callback cb([](const PtrConnection &) {}); // 空的lambda，拷贝不申请内存
+    char payload[64] = {0};
+
+    printf("%d cross-thread tasks each\n", N);
+    Measure("Shutdown/Release (bind member)", loop, [&](int) {
+        loop->QueueInLoop(std::bind(&Probe::ShutdownInLoop, &probe));
+    });
+    int si = 0;
+    Measure("Send(std::string &&) (bind + string)", loop, [&](int) {
+        loop->QueueInLoop(std::bind(&Probe::SendStringInLoop, &probe, std::move(strs[si++])));
+    });
+    Measure("Upgrade (bind Any + 4 callbacks)", loop, [&](int) {
+        loop->QueueInLoop(std::bind(&Probe::UpgradeInLoop, &probe, context, cb, cb, cb, cb));
+    });
+    Measure("Connection::Send(const char *, 64)", loop, [&](int) {
+        conn->Send(payload, sizeof(payload));
+    });
+    printf("-- baseline: the same closures wrapped in std::function --\n");
+    Measure("Shutdown/Release (bind member)", loop, [&](int) {
+        loop->QueueInLoop(TaskFunc(std::bind(&Probe::ShutdownInLoop, &probe)));
+    });
+    for (auto &s : strs)
+        s.assign(1024, 'x');
+    si = 0;
+    Measure("Send(std::string &&) (bind + string)", loop, [&](int) {
+        loop->QueueInLoop(TaskFunc(std::bind(&Probe::SendStringInLoop, &probe, std::move(strs[si++]))));
+    });
+    fflush(stdout);
+    _exit(0);
+}
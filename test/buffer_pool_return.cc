@@ -0,0 +1,76 @@
+// 连接释放后缓冲区的内存块回到租用它的loop的池中：主线程的池不接收连接，不应该缓存任何内存块
+/**
+ * 启动一个有2个从属线程的回显服务器，客户端依次建立连接、发送一条消息、收到回显后关闭
+ * 连接对象在主线程中析构，如果缓冲区在析构时才归还，内存块会堆积到主线程的池里，从属线程每次都要重新申请
+ * 结束之后在各个loop中读取池的统计：主线程的池没有缓存，从属线程的池有缓存并且后面的连接能够命中
+ */
+
+#include "../source/server.hpp"
+
+#include <atomic>
+#include <future>
+
+static std::atomic<TcpServer *> g_server(nullptr);
+
+void OnMessage(const PtrConnection &conn, Buffer *buf)
+{
+    conn->Send(buf->ReadPosition(), buf->ReadableSize());
+    buf->MoveReadOffset(buf->ReadableSize());
+    conn->Shutdown();
+}
+
+void RunServer(uint16_t port)
+{
+    TcpServer *server = new TcpServer(port, 2);
+    server->SetMessageCallback(OnMessage);
+    g_server = server;
+    server->Start();
+}
+
+BufferPool::Stats PoolStats(EventLoop *loop)
+{
+    std::promise<BufferPool::Stats> stats;
+    loop->RunInLoop([&]() { stats.set_value(loop->BufferPoolStats()); });
+    return stats.get_future().get();
+}
+
+int main()
+{
+    const uint16_t port = 9501;
+    const int N = 1000;
+    std::thread server(RunServer, port);
+    while (g_server == nullptr)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    std::string msg(2000, 'x'); // 超过默认大小的消息，输入缓冲区需要租用内存块
+    for (int i = 0; i < N; ++i)
+    {
+        Socket client;
+        if (client.CreateClient(port, "127.0.0.1") == false)
+            return 1;
+        client.Send(msg.c_str(), msg.size());
+        char buf[4096];
+        while (read(client.Fd(), buf, sizeof(buf)) > 0)
+            ;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100)); // 等最后的连接释放
+
+    std::promise<std::vector<EventLoop *>> loops;
+    TcpServer *srv = g_server;
+    srv->GetLoops()[0]->RunInLoop([&]() { loops.set_value(srv->GetLoops()); });
+    std::vector<EventLoop *> all = loops.get_future().get();
+    int fail = 0;
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+        BufferPool::Stats stats = PoolStats(all[i]);
+        printf("loop %lu: hits %lu misses %lu resident %lu bytes\n", i, stats.hits, stats.misses, stats.resident_bytes);
+        if (i == 0 && stats.resident_bytes != 0)
+            fail = 1; // 内存块跑到了主线程的池里
+        if (i > 0 && (stats.resident_bytes == 0 || stats.hits < stats.misses))
+            fail = 1; // 从属线程的内存块没有回来
+    }
+    srv->Stop(100);
+    server.join();
+    printf(fail ? "FAILED\n" : "OK\n");
+    return fail;
+}
@@ -0,0 +1,189 @@
+// HttpContext零拷贝解析的内存申请测试：解析一个典型的GET请求不应该申请任何堆内存
+/**
+ * 通过重载operator new统计申请内存的次数
+ * 同一个上下文先解析一个请求预热（请求头数组申请容量），之后每个请求解析过程中申请内存的次数都应该是0
+ * 分别测试一次收到整个请求和每次只收到几个字节的情况
+ * 然后检查小写的请求方法返回400，不填充字符串成员时GetParam和SetHeader的结果，以及填充之后和原来的解析结果一致
+ * 最后启动一个零拷贝模式的HttpServer，在一个长连接上发送同样的请求：预热之后HttpServer::OnMessage解析、路由、处理、发送响应的整个过程也不申请内存
+ */
+
+#include "../source/http/http.hpp"
+
+#include <atomic>
+
+#include "alloc_counter.hpp"
+
+static const std::string g_request =
+    "GET /index.html?word=C%2B%2B&page=2 HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Cookie: session=0123456789abcdef; theme=dark\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+// 每次往缓冲区写入step字节的数据并解析，返回解析过程中申请内存的次数
+uint64_t ParseOnce(HttpContext &context, Buffer &buffer, size_t step)
+{
+    uint64_t allocs = 0;
+    for (size_t i = 0; i < g_request.size(); i += step)
+    {
+        buffer.WriteAndPush(g_request.c_str() + i, std::min(step, g_request.size() - i));
+        uint64_t before = g_alloc_count.load();
+        context.RecvHttpRequest(&buffer);
+        allocs += g_alloc_count.load() - before;
+    }
+    HttpRequest &req = context.Request();
+    uint64_t before = g_alloc_count.load();
+    bool ok = context.GetState() == RECV_HTTP_OVER && req.Method().Equal("GET") && req.Path().Equal("/index.html") &&
+              req.Query().Equal("word=C%2B%2B&page=2") && req.Version().Equal("HTTP/1.1") &&
+              req.HeaderView("host").Equal("127.0.0.1:8080") && req.KeepAlive() && req.GetBodyLength() == 0;
+    allocs += g_alloc_count.load() - before;
+    if (ok == false)
+    {
+        printf("parse failed, state: %d, statu: %d\n", context.GetState(), context.ResponseStatu());
+        exit(1);
+    }
+    buffer.MoveReadOffset(context.RequestSize());
+    before = g_alloc_count.load();
+    context.Reset();
+    allocs += g_alloc_count.load() - before;
+    return allocs;
+}
+
+static std::atomic<HttpServer *> g_server(nullptr);
+
+void Index(const HttpRequest &req, HttpResponse &rsp)
+{
+    std::string body(req.ParamView("page").Equal("2") ? "hello" : "wrong"); // 短字符串，不申请内存
+    rsp.SetContent(body, "text/plain");
+}
+
+// HttpServer在运行它的线程中创建，这样主线程loop的线程id就是这个线程
+void RunServer(uint16_t port)
+{
+    HttpServer *server = new HttpServer(port);
+    server->SetThreadNum(1);
+    server->EnableLazyRequest();
+    server->Get("/index.html", Index);
+    g_server = server;
+    server->Listen();
+}
+
+// 读取一个完整的响应，返回是否成功；只使用栈上的缓冲区，客户端不申请内存
+bool ReadResponse(int fd)
+{
+    char buf[4096];
+    size_t len = 0;
+    while (len < sizeof(buf) - 1)
+    {
+        ssize_t ret = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (ret <= 0)
+            return false;
+        len += ret;
+        buf[len] = '\0';
+        const char *end = strstr(buf, "\r\n\r\n");
+        const char *cl = strstr(buf, "Content-Length: ");
+        if (end == nullptr || cl == nullptr)
+            continue;
+        size_t total = end + 4 - buf + atoi(cl + strlen("Content-Length: "));
+        if (len >= total)
+            return len == total && strncmp(buf, "HTTP/1.1 200 OK\r\n", 17) == 0 && strcmp(end + 4, "hello") == 0;
+    }
+    return false;
+}
+
+// 在一个长连接上发送n个请求，返回服务器处理这些请求时整个进程申请内存的次数
+uint64_t ServeRequests(int fd, int n)
+{
+    uint64_t before = g_alloc_count.load();
+    for (int i = 0; i < n; ++i)
+    {
+        if (write(fd, g_request.c_str(), g_request.size()) != (ssize_t)g_request.size() || ReadResponse(fd) == false)
+        {
+            printf("request failed\n");
+            exit(1);
+        }
+    }
+    return g_alloc_count.load() - before;
+}
+
+int main()
+{
+    int fail = 0;
+    size_t steps[] = {g_request.size(), 1, 7, 64};
+    for (size_t step : steps)
+    {
+        HttpContext context;
+        Buffer buffer;
+        ParseOnce(context, buffer, step); // 预热
+        uint64_t allocs = 0;
+        for (int i = 0; i < 100; ++i)
+            allocs += ParseOnce(context, buffer, step);
+        printf("step %4lu bytes: %lu allocations in 100 requests\n", step, allocs);
+        if (allocs != 0)
+            fail = 1;
+    }
+    // 请求方法区分大小写，小写的方法返回400，缓冲区中的数据不被修改
+    {
+        HttpContext lower;
+        Buffer data;
+        data.WriteStringAndPush("get /index.html HTTP/1.1\r\n\r\n");
+        lower.RecvHttpRequest(&data);
+        if (lower.ResponseStatu() != 400 || memcmp(data.ReadPosition(), "get ", 4) != 0)
+        {
+            printf("lowercase method accepted\n");
+            fail = 1;
+        }
+    }
+    // 不填充字符串成员：处理函数拿到的const请求上直接在查询字符串中查找，设置的头部覆盖收到的头部
+    HttpContext context;
+    Buffer buffer;
+    buffer.WriteStringAndPush(g_request);
+    context.RecvHttpRequest(&buffer);
+    HttpRequest &req = context.Request();
+    const HttpRequest &creq = req;
+    if (creq.GetParam("word") != "C%2B%2B" || creq.HaveParam("page") == false || creq.HaveParam("pag") ||
+        req._params.empty() == false)
+    {
+        printf("lazy param failed\n");
+        fail = 1;
+    }
+    req.SetHeader("Connection", "close");
+    req.SetHeader("X-Trace", "1");
+    if (creq.KeepAlive() || creq.GetHeader("x-trace") != "1" || creq.GetHeader("Host") != "127.0.0.1:8080")
+    {
+        printf("set header failed\n");
+        fail = 1;
+    }
+    // 填充之后和原来的解析结果一致，SetHeader设置的头部不被覆盖
+    req.Materialize();
+    if (req._method != "GET" || req._path != "/index.html" || req._params["word"] != "C%2B%2B" ||
+        req._headers["Connection"] != "close" || req._headers["Host"] != "127.0.0.1:8080" || creq.KeepAlive())
+    {
+        printf("materialize failed\n");
+        fail = 1;
+    }
+
+    const uint16_t port = 9502;
+    std::thread server(RunServer, port);
+    while (g_server == nullptr)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    Socket client;
+    if (client.CreateClient(port, "127.0.0.1") == false)
+        return 1;
+    ServeRequests(client.Fd(), 10); // 预热：上下文、缓冲区、响应头部数组和路径缓冲区申请容量
+    uint64_t allocs = ServeRequests(client.Fd(), 100);
+    printf("HttpServer::OnMessage: %lu allocations in 100 requests\n", allocs);
+    if (allocs != 0)
+        fail = 1;
+    client.Close();
+    g_server.load()->Stop(100);
+    server.join();
+    delete g_server.load();
+    printf(fail ? "FAILED\n" : "OK\n");
+    return fail;
+}
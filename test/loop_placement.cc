@@ -0,0 +1,64 @@
+// 线程绑核的结果：每个loop实际所在的cpu和NUMA节点可以通过TcpServer::GetPlacement读取
+/**
+ * 在进程允许使用的cpu中选择，主线程绑定到第一个，从属线程依次绑定到后面的cpu上（cpu不够就循环使用）
+ * 启动之后在主线程loop中读取每个loop的位置，绑定的cpu和实际所在的cpu应该一致，NUMA节点有效
+ * 用法：./loop_placement [从属线程数]
+ */
+
+#include "../source/server.hpp"
+
+#include <atomic>
+#include <future>
+
+static std::atomic<TcpServer *> g_server(nullptr);
+
+// TcpServer在运行它的线程中创建，绑核的是调用Start的线程
+void RunServer(uint16_t port, int threads, int accept_cpu, const std::vector<int> &loop_cpus)
+{
+    TcpServer *server = new TcpServer(port, threads);
+    server->SetAcceptCpu(accept_cpu);
+    server->SetLoopCpus(loop_cpus);
+    server->EnableNumaLocal();
+    g_server = server;
+    server->Start();
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    std::vector<int> allowed;
+    for (int i = 0; i < CPU_SETSIZE; ++i)
+    {
+        if (CPU_ISSET(i, &set))
+            allowed.push_back(i);
+    }
+    std::vector<int> expect; // 每个loop应该所在的cpu，顺序和GetPlacement一致
+    for (int i = 0; i <= threads; ++i)
+        expect.push_back(allowed[i % allowed.size()]);
+    std::vector<int> loop_cpus(expect.begin() + 1, expect.end());
+
+    std::thread server(RunServer, 9503, threads, expect[0], loop_cpus);
+    while (g_server == nullptr)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    // 主线程loop开始运行时位置已经确定，从属线程也已经创建完成
+    std::promise<std::vector<LoopThreadPool::Placement>> placement;
+    TcpServer *srv = g_server;
+    srv->GetLoops()[0]->RunInLoop([&]() { placement.set_value(srv->GetPlacement()); });
+    std::vector<LoopThreadPool::Placement> all = placement.get_future().get();
+
+    int fail = all.size() != expect.size();
+    for (size_t i = 0; i < all.size() && i < expect.size(); ++i)
+    {
+        printf("loop %lu: cpu %d (pinned to %d), numa node %d\n", i, all[i].cpu, expect[i], all[i].node);
+        if (all[i].cpu != expect[i] || all[i].node < 0)
+            fail = 1;
+    }
+    srv->Stop(100);
+    server.join();
+    delete srv;
+    printf(fail ? "FAILED\n" : "OK\n");
+    return fail;
+}
@@ -0,0 +1,214 @@
+// 连接迁移的正确性测试：客户端不停收发数据的时候迁移连接，数据不丢失、不重复，迁移的统计和实际一致
+/**
+ * 启动一个有4个从属线程的回显服务器，按IP哈希分配，所有客户端都来自127.0.0.1，连接全部落在同一个loop上
+ * 打开迁移（阈值1），主线程会不停地把空闲的连接迁移到连接少的loop，直到各个loop的连接数相差不超过1
+ * 每个客户端不停地发送随机长度的数据，数据内容是按字节偏移计算的序列，收到回显后逐字节检查，丢失、重复或者乱序都会被发现
+ * 服务器在每次收到数据时检查连接所在的loop有没有变化，变化的次数应该等于迁移成功的连接数
+ * 各个loop稳定之后，每个客户端再收发一次（让迁移之后的loop都被观察到），然后在各个loop中检查：
+ *  连接数的计数和连接列表的大小一致，所有loop的连接数之和等于客户端个数，连接分布是均衡的
+ * 客户端关闭之后，服务器收到的总字节数等于客户端发送的总字节数，各个loop的连接数回到0
+ */
+
+#include "../source/server.hpp"
+
+#include <atomic>
+#include <future>
+
+static std::atomic<TcpServer *> g_server(nullptr);
+static std::atomic<uint64_t> g_hops(0);         // 服务器观察到的连接换loop的次数
+static std::atomic<uint64_t> g_server_bytes(0); // 服务器收到的总字节数，连接关闭的时候累加
+static std::atomic<bool> g_stop(false);         // 客户端停止收发
+static std::atomic<bool> g_close(false);        // 客户端关闭连接
+static std::atomic<int> g_ready(0);             // 完成第一次收发的客户端个数
+static std::atomic<int> g_done(0);              // 完成最后一次收发的客户端个数
+static std::atomic<int> g_fail(0);
+const size_t MaxChunk = 8192; // 客户端每次发送的最大长度
+
+struct ConnState
+{
+    EventLoop *loop; // 上一次收到数据时连接所在的loop
+    uint64_t bytes;  // 收到的字节数
+};
+
+void OnConnected(const PtrConnection &conn)
+{
+    ConnState state = {conn->GetLoop(), 0};
+    conn->SetContext(state);
+}
+
+void OnMessage(const PtrConnection &conn, Buffer *buf)
+{
+    ConnState *state = conn->GetContext()->get<ConnState>();
+    EventLoop *loop = conn->GetLoop();
+    if (loop->IsInLoop() == false)
+    {
+        printf("message handled outside the owner loop\n");
+        g_fail = 1;
+    }
+    if (state->loop != loop)
+    {
+        state->loop = loop;
+        g_hops.fetch_add(1);
+    }
+    state->bytes += buf->ReadableSize();
+    conn->Send(buf->ReadPosition(), buf->ReadableSize());
+    buf->MoveReadOffset(buf->ReadableSize());
+}
+
+void OnClosed(const PtrConnection &conn)
+{
+    g_server_bytes.fetch_add(conn->GetContext()->get<ConnState>()->bytes);
+}
+
+void RunServer(uint16_t port, int threads)
+{
+    TcpServer *server = new TcpServer(port, threads);
+    server->SetLoadBalancer(LB_IP_HASH);
+    server->EnableRebalance(20, 1, 4);
+    server->SetConnectedCallback(OnConnected);
+    server->SetMessageCallback(OnMessage);
+    server->SetClosedCallback(OnClosed);
+    g_server = server;
+    server->Start();
+}
+
+// 发送一段数据并收回显，内容是从offset开始的序列
+bool RoundTrip(int fd, uint64_t &offset, size_t len)
+{
+    char out[MaxChunk], in[MaxChunk];
+    for (size_t i = 0; i < len; ++i)
+        out[i] = (char)((offset + i) % 251);
+    size_t sent = 0, got = 0;
+    while (sent < len)
+    {
+        ssize_t n = write(fd, out + sent, len - sent);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    while (got < len)
+    {
+        ssize_t n = read(fd, in + got, len - got);
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+    if (memcmp(in, out, len) != 0)
+    {
+        printf("echo mismatch at offset %lu\n", offset);
+        return false;
+    }
+    offset += len;
+    return true;
+}
+
+void RunClient(uint16_t port, unsigned seed, uint64_t *sent)
+{
+    Socket client;
+    uint64_t offset = 0;
+    bool ok = client.CreateClient(port, "127.0.0.1") && RoundTrip(client.Fd(), offset, 1);
+    ++g_ready;
+    while (ok && g_stop == false)
+        ok = RoundTrip(client.Fd(), offset, 1 + rand_r(&seed) % MaxChunk);
+    ok = ok && RoundTrip(client.Fd(), offset, 100); // 稳定之后的最后一次收发
+    if (ok == false)
+        g_fail = 1;
+    *sent = offset;
+    ++g_done;
+    while (g_close == false)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+std::vector<EventLoop *> WorkerLoops(TcpServer *srv)
+{
+    std::promise<std::vector<EventLoop *>> loops;
+    srv->GetLoops()[0]->RunInLoop([&]() { loops.set_value(srv->GetLoops()); });
+    std::vector<EventLoop *> all = loops.get_future().get();
+    all.erase(all.begin()); // 主线程的loop不处理连接
+    return all;
+}
+
+int64_t Spread(const std::vector<EventLoop *> &loops)
+{
+    int64_t most = 0, least = INT64_MAX;
+    for (EventLoop *loop : loops)
+    {
+        most = std::max(most, loop->ActiveConnections());
+        least = std::min(least, loop->ActiveConnections());
+    }
+    return most - least;
+}
+
+int main()
+{
+    const uint16_t port = 9504;
+    const int Threads = 4;
+    const int N = 16;
+    std::thread server(RunServer, port, Threads);
+    while (g_server == nullptr)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    TcpServer *srv = g_server;
+    std::vector<EventLoop *> loops = WorkerLoops(srv);
+
+    std::vector<std::thread> clients;
+    std::vector<uint64_t> sent(N, 0);
+    for (int i = 0; i < N; ++i)
+        clients.emplace_back(RunClient, port, i + 1, &sent[i]);
+    while (g_ready < N)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    // 等到连接分布均衡，并且连续几个迁移周期都没有新的迁移
+    int stable = 0;
+    uint64_t last_migrated = UINT64_MAX;
+    for (int i = 0; i < 1000 && stable < 5; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        uint64_t migrated = srv->GetMigrationStats().migrated;
+        stable = (Spread(loops) <= 1 && migrated == last_migrated) ? stable + 1 : 0;
+        last_migrated = migrated;
+    }
+    g_stop = true;
+    while (g_done < N)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    int fail = g_fail;
+    TcpServer::MigrationStats stats = srv->GetMigrationStats();
+    printf("rounds %lu migrated %lu skipped %lu observed %lu\n", stats.rounds, stats.migrated, stats.skipped, g_hops.load());
+    if (stable < 5 || stats.migrated == 0 || stats.migrated != g_hops)
+        fail = 1;
+    int64_t total = 0;
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        std::promise<std::pair<int64_t, size_t>> count;
+        EventLoop *loop = loops[i];
+        loop->RunInLoop([&]() { count.set_value(std::make_pair(loop->ActiveConnections(), loop->Connections().size())); });
+        std::pair<int64_t, size_t> c = count.get_future().get();
+        printf("loop %lu: active %ld listed %lu\n", i + 1, c.first, c.second);
+        if (c.first != (int64_t)c.second || c.first < N / Threads - 1 || c.first > N / Threads + 1)
+            fail = 1;
+        total += c.first;
+    }
+    if (total != N)
+        fail = 1;
+
+    g_close = true;
+    for (std::thread &t : clients)
+        t.join();
+    uint64_t client_bytes = 0;
+    for (uint64_t n : sent)
+        client_bytes += n;
+    for (int i = 0; i < 1000 && (total > 0 || g_server_bytes != client_bytes); ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        total = 0;
+        for (EventLoop *loop : loops)
+            total += loop->ActiveConnections();
+    }
+    printf("client sent %lu bytes, server received %lu bytes\n", client_bytes, g_server_bytes.load());
+    if (total != 0 || g_server_bytes != client_bytes)
+        fail = 1;
+    srv->Stop(100);
+    server.join();
+    printf(fail ? "FAILED\n" : "OK\n");
+    return fail;
+}
@@ -0,0 +1,218 @@
+// 分层时间轮的正确性测试：每个定时任务只执行一次、按到期时间的顺序执行、不会提前执行
+/**
+ * 时间轮使用模拟的时间，测试程序自己推进时间并调用RunTimerTask，几十天的延迟也可以马上测完
+ * 定时任务的延迟覆盖各层的边界：第0层以内（小于256毫秒）、第1层（约16秒以内）、几秒到十几分钟、超过17分钟的第3层、第4层直到MaxDelay
+ * 一部分任务在中途取消，一部分在中途刷新（按原来的超时时间重新计时），还有一部分通过id添加、刷新和取消
+ * 时间先每次走1毫秒，再随机走几毫秒到几秒，最后每次走几分钟到几十分钟（一次跨过很多槽，检查级联）
+ * 每次推进时间后检查：执行的任务到期时间在上一次的时间之后、当前时间之前（既不提前，也不会拖到下一次），同一次推进中按到期时间的顺序执行
+ * 最后检查没有取消的任务都执行了一次，取消的任务没有执行
+ */
+
+#include "../source/server.hpp"
+
+static uint64_t g_now;      // 模拟的当前时间（毫秒）
+static uint64_t g_prev_now; // 上一次推进之前的时间
+static uint64_t g_last_expire;
+static int g_fail = 0;
+
+uint64_t FakeClock() { return g_now; }
+
+struct Probe
+{
+    TimerTask timer;
+    uint32_t delay;  // 超时时间
+    uint64_t expire; // 期望的到期时间
+    int fired;       // 执行的次数
+    bool canceled;
+};
+
+void OnFire(Probe *p)
+{
+    ++p->fired;
+    if (p->expire <= g_prev_now || p->expire > g_now)
+    {
+        printf("timer expire %lu fired at %lu (previous run at %lu)\n", p->expire, g_now, g_prev_now);
+        g_fail = 1;
+    }
+    if (p->expire < g_last_expire)
+    {
+        printf("timer expire %lu fired after expire %lu\n", p->expire, g_last_expire);
+        g_fail = 1;
+    }
+    g_last_expire = p->expire;
+}
+
+static uint64_t g_rand = 88172645463325252ULL;
+uint64_t Rand(uint64_t n) // xorshift，结果是固定的，失败的时候可以复现
+{
+    g_rand ^= g_rand << 13;
+    g_rand ^= g_rand >> 7;
+    g_rand ^= g_rand << 17;
+    return g_rand % n;
+}
+
+void Advance(TimerWheel &wheel, uint64_t step)
+{
+    g_prev_now = g_now;
+    g_now += step;
+    g_last_expire = 0;
+    wheel.RunTimerTask();
+}
+
+Probe *NewProbe(uint32_t delay)
+{
+    Probe *p = new Probe;
+    p->delay = delay;
+    p->expire = g_now + delay;
+    p->fired = 0;
+    p->canceled = false;
+    return p;
+}
+
+int Check(const std::vector<std::unique_ptr<Probe>> &probes, const char *name)
+{
+    int fired = 0, canceled = 0, fail = 0;
+    for (auto &p : probes)
+    {
+        if (p->canceled)
+            ++canceled;
+        else
+            fired += p->fired;
+        if (p->fired != (p->canceled ? 0 : 1))
+        {
+            printf("%s timer delay %u expire %lu canceled %d fired %d times\n", name, p->delay, p->expire, p->canceled, p->fired);
+            fail = 1;
+        }
+    }
+    printf("%s timers: %zu, fired: %d, canceled: %d\n", name, probes.size(), fired, canceled);
+    return fail;
+}
+
+int main()
+{
+    g_now = 1000000;
+    EventLoop loop;
+    TimerWheel wheel(&loop); // 只用来测试，不运行loop；在loop的线程中，通过id的接口会直接执行
+    wheel.SetClock(FakeClock);
+
+    if (TimerWheel::SecondsToMs(30) != 30000 || TimerWheel::SecondsToMs(4294967) != 4294967000u ||
+        TimerWheel::SecondsToMs(4294968) != TimerWheel::MaxDelay || TimerWheel::SecondsToMs(UINT64_MAX) != TimerWheel::MaxDelay)
+    {
+        printf("SecondsToMs overflow\n");
+        g_fail = 1;
+    }
+
+    // 各层边界附近的固定延迟，以及各个范围内的随机延迟
+    std::vector<uint32_t> delays = {1, 2, 255, 256, 257, 511, 512, 3000, 16383, 16384, 16385, 65535, 65536,
+                                    (1u << 20) - 1, 1u << 20, (1u << 20) + 1, 20 * 60 * 1000, (1u << 26) - 1, 1u << 26,
+                                    (1u << 26) + 1, 30u * 24 * 3600 * 1000, TimerWheel::MaxDelay - 1, TimerWheel::MaxDelay};
+    uint64_t ranges[] = {256, 16384, 1u << 20, 1u << 26, TimerWheel::MaxDelay};
+    for (uint64_t range : ranges)
+    {
+        for (int i = 0; i < 400; ++i)
+            delays.push_back(1 + Rand(range));
+    }
+    std::vector<std::unique_ptr<Probe>> probes;
+    for (uint32_t delay : delays)
+    {
+        Probe *p = NewProbe(delay);
+        p->timer.SetCallback(std::bind(OnFire, p));
+        wheel.TimerStart(&p->timer, delay);
+        probes.emplace_back(p);
+    }
+    // 通过id添加的任务，节点来自时间轮的节点池
+    const int IdTimers = 300;
+    std::vector<std::unique_ptr<Probe>> id_probes;
+    for (int i = 0; i < IdTimers; ++i)
+    {
+        Probe *p = NewProbe(1 + Rand(i % 2 ? 1u << 22 : 4000));
+        wheel.TimerAdd(i + 1, p->delay, std::bind(OnFire, p));
+        id_probes.emplace_back(p);
+    }
+
+    // 中途取消和刷新一部分还没有执行的任务
+    auto disturb = [&](int round) {
+        for (size_t i = 0; i < probes.size(); ++i)
+        {
+            Probe *p = probes[i].get();
+            if (p->fired || p->canceled)
+                continue;
+            if (i % 7 == (size_t)round)
+            {
+                wheel.TimerStop(&p->timer);
+                p->canceled = true;
+            }
+            else if (i % 5 == (size_t)round)
+            {
+                wheel.TimerRestart(&p->timer); // 按原来的超时时间从现在开始重新计时
+                p->expire = g_now + p->delay;
+            }
+        }
+        for (int i = 0; i < IdTimers; ++i)
+        {
+            Probe *p = id_probes[i].get();
+            if (p->fired || p->canceled)
+                continue;
+            if (i % 7 == round)
+            {
+                wheel.TimerCancel(i + 1);
+                p->canceled = true;
+            }
+            else if (i % 5 == round)
+            {
+                wheel.TimerRefresh(i + 1);
+                p->expire = g_now + p->delay;
+            }
+        }
+    };
+
+    // 1. 每次走1毫秒
+    for (int ms = 1; ms <= 3000; ++ms)
+    {
+        Advance(wheel, 1);
+        if (ms == 100)
+            disturb(0);
+        else if (ms == 2000)
+            disturb(1);
+    }
+    // 2. 每次随机走几毫秒到几秒，走到30分钟
+    while (g_now < 1000000 + 30 * 60 * 1000)
+    {
+        Advance(wheel, 1 + Rand(Rand(2) ? 50 : 5000));
+        if (g_now >= 1000000 + 10 * 60 * 1000 && g_prev_now < 1000000 + 10 * 60 * 1000)
+            disturb(2);
+    }
+    // 3. 每次随机走几分钟到几十分钟，直到所有任务都到期
+    auto last = [&]() {
+        uint64_t expire = 0;
+        for (auto &p : probes)
+            expire = std::max(expire, p->expire);
+        for (auto &p : id_probes)
+            expire = std::max(expire, p->expire);
+        return expire;
+    };
+    bool disturbed = false;
+    while (g_now < last())
+    {
+        Advance(wheel, 1 + Rand(Rand(2) ? 5 * 60 * 1000 : 40 * 60 * 1000));
+        if (disturbed == false && g_now >= 1000000 + 20ull * 24 * 3600 * 1000)
+        {
+            disturb(3);
+            disturbed = true;
+        }
+    }
+    Advance(wheel, 1);
+
+    g_fail |= Check(probes, "owned");
+    g_fail |= Check(id_probes, "id");
+    for (int i = 0; i < IdTimers; ++i)
+    {
+        if (wheel.HaveTimer(i + 1))
+        {
+            printf("id %d still in the wheel\n", i + 1);
+            g_fail = 1;
+        }
+    }
+    printf("%s\n", g_fail ? "FAILED" : "OK");
+    return g_fail;
+}
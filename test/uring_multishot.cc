@@ -0,0 +1,214 @@
+// io_uring后端的完成式读：多次触发的accept和使用提供缓冲区的环的多次触发recv，数据不丢失、不重复、不乱序
+/**
+ * 启动一个有2个从属线程的回显服务器，使用POLLER_IO_URING，每个loop只有256个4KB的缓冲区
+ * 1. 16个客户端同时收发随机长度（最长64KB）的数据，一次收发要用掉很多缓冲区，环经常用完（recv以ENOBUFS结束再重新提交）
+ * 2. 4个客户端先写32MB不读（回环的套接字缓冲区有几MB），服务器的输出缓冲区超过高水位暂停读（取消recv），客户端开始读之后降到低水位恢复读（重新提交recv）
+ * 3. 50个客户端发送数据之后半关闭，服务器收到对端关闭（recv返回0）之前的数据都要回显
+ * 4. 1000次短连接：每个新连接都由多次触发的accept接收，描述符不停地复用，过期的完成事件不能交给新的连接
+ * 每次收到回显都逐字节检查内容，最后检查所有连接都释放了
+ * 内核不支持io_uring或者多次触发的recv时会退回epoll或者poll，同样检查数据，并打印实际使用的方式
+ */
+
+#include "../source/server.hpp"
+
+#include <atomic>
+#include <future>
+
+static std::atomic<TcpServer *> g_server(nullptr);
+static std::atomic<int> g_fail(0);
+static std::atomic<int> g_paused(0); // 超过高水位的次数
+static std::atomic<int> g_closed(0); // 释放的连接数
+const size_t MaxChunk = 65536;
+
+void OnMessage(const PtrConnection &conn, Buffer *buf)
+{
+    conn->Send(buf->ReadPosition(), buf->ReadableSize());
+    buf->MoveReadOffset(buf->ReadableSize());
+}
+
+void RunServer(uint16_t port)
+{
+    TcpServer *server = new TcpServer(port, 2, POLLER_IO_URING);
+    server->SetMessageCallback(OnMessage);
+    server->SetClosedCallback([](const PtrConnection &) { ++g_closed; });
+    server->SetHighWaterMarkCallback(256 * 1024, [](const PtrConnection &, uint64_t) { ++g_paused; });
+    server->SetLowWaterMarkCallback(64 * 1024, nullptr);
+    server->SetPauseReadOnHighWater(true);
+    g_server = server;
+    server->Start();
+}
+
+void Fill(char *out, uint64_t offset, size_t len) // 内容是按字节偏移计算的序列
+{
+    for (size_t i = 0; i < len; ++i)
+        out[i] = (char)((offset + i) % 251);
+}
+
+bool WriteAll(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// 读取len字节（len为0时读到对端关闭），检查内容，返回读到的字节数
+uint64_t ReadCheck(int fd, uint64_t offset, uint64_t len)
+{
+    char in[MaxChunk], expect[MaxChunk];
+    uint64_t got = 0;
+    while (len == 0 || got < len)
+    {
+        size_t want = len == 0 ? sizeof(in) : std::min<uint64_t>(sizeof(in), len - got);
+        ssize_t n = read(fd, in, want);
+        if (n <= 0)
+            break;
+        Fill(expect, offset + got, n);
+        if (memcmp(in, expect, n) != 0)
+        {
+            printf("echo mismatch at offset %lu\n", offset + got);
+            g_fail = 1;
+            break;
+        }
+        got += n;
+    }
+    return got;
+}
+
+void Streaming(uint16_t port, unsigned seed)
+{
+    Socket client;
+    if (client.CreateClient(port, "127.0.0.1") == false)
+        return (void)(g_fail = 1);
+    char out[MaxChunk];
+    uint64_t offset = 0;
+    for (int i = 0; i < 200; ++i)
+    {
+        size_t len = 1 + rand_r(&seed) % MaxChunk;
+        Fill(out, offset, len);
+        if (WriteAll(client.Fd(), out, len) == false || ReadCheck(client.Fd(), offset, len) != len)
+            return (void)(g_fail = 1);
+        offset += len;
+    }
+}
+
+void BackPressure(uint16_t port)
+{
+    const uint64_t Total = 32 << 20;
+    Socket client;
+    if (client.CreateClient(port, "127.0.0.1") == false)
+        return (void)(g_fail = 1);
+    std::thread writer([&]() {
+        char out[MaxChunk];
+        for (uint64_t offset = 0; offset < Total; offset += sizeof(out))
+        {
+            Fill(out, offset, sizeof(out));
+            if (WriteAll(client.Fd(), out, sizeof(out)) == false)
+                return (void)(g_fail = 1);
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(300)); // 先不读，让服务器的输出缓冲区堆积
+    if (ReadCheck(client.Fd(), 0, Total) != Total)
+        g_fail = 1;
+    writer.join();
+}
+
+void HalfClose(uint16_t port, size_t len)
+{
+    Socket client;
+    if (client.CreateClient(port, "127.0.0.1") == false)
+        return (void)(g_fail = 1);
+    std::unique_ptr<char[]> out(new char[len]);
+    Fill(out.get(), 0, len);
+    if (WriteAll(client.Fd(), out.get(), len) == false)
+        return (void)(g_fail = 1);
+    shutdown(client.Fd(), SHUT_WR);
+    uint64_t got = ReadCheck(client.Fd(), 0, 0); // 服务器回显完之后关闭连接
+    if (got != len)
+    {
+        printf("half close: sent %lu, echoed %lu\n", len, got);
+        g_fail = 1;
+    }
+}
+
+int main()
+{
+    const uint16_t port = 9505;
+    std::thread server(RunServer, port);
+    while (g_server == nullptr)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    TcpServer *srv = g_server;
+    std::promise<std::vector<EventLoop *>> promise;
+    srv->GetLoops()[0]->RunInLoop([&]() { promise.set_value(srv->GetLoops()); });
+    std::vector<EventLoop *> loops = promise.get_future().get();
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+        std::promise<std::pair<PollerType, bool>> mode;
+        EventLoop *loop = loops[i];
+        loop->RunInLoop([&]() { mode.set_value(std::make_pair(loop->GetPollerType(), loop->SupportCompletion(COMPLETION_RECV))); });
+        std::pair<PollerType, bool> m = mode.get_future().get();
+        printf("loop %lu: %s, %s\n", i, m.first == POLLER_IO_URING ? "io_uring" : "epoll", m.second ? "multishot accept/recv" : "readiness only");
+    }
+    int connections = 0;
+
+    std::vector<std::thread> clients;
+    for (int i = 0; i < 16; ++i)
+        clients.emplace_back(Streaming, port, i + 1);
+    for (std::thread &t : clients)
+        t.join();
+    connections += clients.size();
+    clients.clear();
+    printf("streaming done\n");
+
+    for (int i = 0; i < 4; ++i)
+        clients.emplace_back(BackPressure, port);
+    for (std::thread &t : clients)
+        t.join();
+    connections += clients.size();
+    clients.clear();
+    printf("back pressure done, paused %d times\n", g_paused.load());
+    if (g_paused == 0)
+        g_fail = 1;
+
+    for (int i = 0; i < 50; ++i)
+        clients.emplace_back(HalfClose, port, 1 + i * 3001);
+    for (std::thread &t : clients)
+        t.join();
+    connections += clients.size();
+    clients.clear();
+    printf("half close done\n");
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        Socket client;
+        char c = 'x';
+        if (client.CreateClient(port, "127.0.0.1") == false || write(client.Fd(), &c, 1) != 1 || read(client.Fd(), &c, 1) != 1 || c != 'x')
+        {
+            g_fail = 1;
+            break;
+        }
+        ++connections;
+    }
+    printf("short connections done\n");
+
+    int64_t active = -1;
+    for (int i = 0; i < 1000 && (active != 0 || g_closed != connections); ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        active = 0;
+        for (EventLoop *loop : loops)
+            active += loop->ActiveConnections();
+    }
+    printf("connections %d, closed %d, active %ld\n", connections, g_closed.load(), active);
+    if (active != 0 || g_closed != connections)
+        g_fail = 1;
+    srv->Stop(100);
+    server.join();
+    printf(g_fail ? "FAILED\n" : "OK\n");
+    return g_fail;
+}